@@ -1,44 +1,421 @@
 #include "fast_mcmt.hpp"
 #include "kdtree.hpp"
 #include <tbb/tbb.h>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 
 namespace GEO
 {
+    namespace
+    {
+        // estimate of geogram's storage: cell to vertex and cell to cell
+        // tables, cell lists and the vertex to cell table
+        const size_t bytes_per_cell = 40;
+        const size_t bytes_per_vertex = 8;
+        // store entries of a new point and its ~6.5 tets
+        const size_t bytes_per_new_point = 320;
+        // KD-tree copy of a point, its value and its share of the index
+        const size_t kdtree_bytes_per_point = 96;
+        // extraction scratch of a crossed tet: its edges, the sorting buffer,
+        // the vertices and faces it adds
+        const size_t bytes_per_crossed_tet = 256;
+        // header and heap block of an element of the nested vector meshes
+        const size_t nested_vector_bytes = 48;
+
+        size_t mesh_bytes(const std::vector<double> &vertices, const std::vector<int> &faces, const std::vector<double> *normals)
+        {
+            return (vertices.capacity() + (normals ? normals->capacity() : 0)) * sizeof(double) + faces.capacity() * sizeof(int);
+        }
+
+        size_t triangulation_bytes(const PeriodicDelaunay3d *delaunay)
+        {
+            if (!delaunay)
+                return 0;
+            return size_t(delaunay->nb_cells()) * bytes_per_cell + size_t(delaunay->nb_vertices()) * bytes_per_vertex;
+        }
+
+        // state file: this header, then 8 byte aligned arrays of positions
+        // (3 per point), values, errors, volumes (num_volumes) and the
+        // volume_changed_ flags (num_volumes bytes). Host byte order.
+        // Version 2 stores the points in a spatially sorted insertion order
+        const char state_magic[8] = {'M', 'C', 'M', 'T', 'S', 'T', 'A', 'T'};
+        const uint32_t state_version = 2;
+        enum StateFlags
+        {
+            STATE_PERIODIC = 1,
+            STATE_FIXED_DOMAIN = 2,
+            STATE_INSERTION_ORDER = 4
+        };
+        // 104 bytes, followed by the positions, values, errors and volumes
+        // as doubles and the volume flags padded to 8 bytes
+        struct StateHeader
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t flags;
+            uint32_t boundary_mode;
+            uint32_t reserved;
+            uint64_t num_points;
+            uint64_t num_point_visited;
+            uint64_t num_volumes;
+            double domain_min[3];
+            double domain_max[3];
+            double period;
+        };
+        static_assert(sizeof(StateHeader) == 104, "the state header layout is part of the file format");
+
+        // cells per task of the grid exports
+        const index_t grid_block_size = 4096;
+
+        // pull of the dual vertices towards the mean of their edge crossings,
+        // relative to the unit normals of the QEF
+        const double qef_regularization = 0.05;
+        const double two_pi = 6.28318530717958647692;
+
+        // local vertex pairs of the 6 edges of a tet
+        const int tet_edges[6][2] = {{0, 1}, {0, 2}, {0, 3}, {1, 2}, {1, 3}, {2, 3}};
+        // triangles of the marching tets cases as local edges of tet_edges,
+        // 2 at most, the last entry is their count
+        const int marching_tet_triangles[16][7] = {
+            {0, 0, 0, 0, 0, 0, 0},
+            {0, 1, 2, 0, 0, 0, 1},
+            {0, 4, 3, 0, 0, 0, 1},
+            {2, 4, 1, 1, 4, 3, 2},
+            {1, 3, 5, 0, 0, 0, 1},
+            {2, 0, 3, 3, 5, 2, 2},
+            {0, 4, 1, 4, 5, 1, 2},
+            {2, 4, 5, 0, 0, 0, 1},
+            {4, 2, 5, 0, 0, 0, 1},
+            {0, 1, 4, 4, 1, 5, 2},
+            {2, 3, 0, 3, 2, 5, 2},
+            {3, 1, 5, 0, 0, 0, 1},
+            {4, 2, 1, 1, 3, 4, 2},
+            {0, 3, 4, 0, 0, 0, 1},
+            {0, 2, 1, 0, 0, 0, 1},
+            {0, 0, 0, 0, 0, 0, 0}};
+
+        double determinant(const double A[3][3])
+        {
+            return A[0][0] * (A[1][1] * A[2][2] - A[1][2] * A[2][1]) - A[0][1] * (A[1][0] * A[2][2] - A[1][2] * A[2][0]) +
+                   A[0][2] * (A[1][0] * A[2][1] - A[1][1] * A[2][0]);
+        }
+
+        // A x = b by Cramer's rule, false when A is close to singular
+        bool solve_3x3(const double A[3][3], const double b[3], double x[3])
+        {
+            double det = determinant(A);
+            double trace = A[0][0] + A[1][1] + A[2][2];
+            if (std::abs(det) <= 1e-12 * trace * trace * trace)
+                return false;
+            for (int c = 0; c < 3; c++)
+            {
+                double M[3][3];
+                for (int r = 0; r < 3; r++)
+                {
+                    for (int k = 0; k < 3; k++)
+                    {
+                        M[r][k] = k == c ? b[r] : A[r][k];
+                    }
+                }
+                x[c] = determinant(M) / det;
+            }
+            return true;
+        }
+
+        size_t padded(size_t bytes)
+        {
+            return (bytes + 7) & ~size_t(7);
+        }
+
+        // BRIO order of the points, sorted separately within [0, num_volumes),
+        // [num_volumes, num_point_visited) and [num_point_visited, n) so that
+        // both prefixes keep their meaning. Keeps the saved arrays spatially
+        // coherent, the triangulation is still rebuilt in a global order
+        std::vector<index_t> insertion_order(const std::vector<double> &positions, size_t num_volumes, size_t num_point_visited)
+        {
+            size_t n = positions.size() / 3;
+            std::vector<size_t> bounds = {0, num_volumes, num_point_visited, n};
+            std::sort(bounds.begin(), bounds.end());
+            bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+            std::vector<index_t> order;
+            order.reserve(n);
+            for (size_t r = 0; r + 1 < bounds.size(); r++)
+            {
+                size_t b = bounds[r], e = bounds[r + 1];
+                GEO::vector<index_t> sorted;
+                compute_BRIO_order(index_t(e - b), positions.data() + b * 3, sorted, 3, 3);
+                for (index_t i : sorted)
+                {
+                    order.push_back(index_t(b + i));
+                }
+            }
+            return order;
+        }
+
+        template <class T>
+        std::vector<T> gather(const std::vector<T> &values, const std::vector<index_t> &order, size_t stride)
+        {
+            std::vector<T> gathered(values.size());
+            tbb::parallel_for(size_t(0), std::min(order.size(), values.size() / stride), [&](size_t i)
+                              { std::copy_n(values.begin() + order[i] * stride, stride, gathered.begin() + i * stride); });
+            return gathered;
+        }
+    }
+
     MCMT::MCMT()
     {
         GEO::initialize();
-        delaunay_ = new PeriodicDelaunay3d(periodic_, 1.0);
+        delaunay_ = create_delaunay();
+    }
+
+    MCMT::~MCMT()
+    {
+        delete delaunay_;
+        delete lloyd_delaunay_;
+    }
+
+    PeriodicDelaunay3d *MCMT::create_delaunay() const
+    {
+        PeriodicDelaunay3d *delaunay = new PeriodicDelaunay3d(periodic_, period_);
         if (!periodic_)
         {
-            delaunay_->set_keeps_infinite(true);
+            delaunay->set_keeps_infinite(true);
         }
+        return delaunay;
     }
 
-    MCMT::~MCMT()
+    void MCMT::enable_trace(bool enable)
     {
-        delete delaunay_;
+        if (!enable)
+        {
+            trace_.reset();
+        }
+        else if (!trace_)
+        {
+            trace_.reset(new TraceRecorder());
+        }
+    }
+
+    bool MCMT::save_trace(const std::string &filename) const
+    {
+        return trace_ && trace_->write(filename);
+    }
+
+    MemoryUsage MCMT::get_memory_usage()
+    {
+        track_memory();
+        return memory_usage_;
+    }
+
+    void MCMT::track_memory(size_t kdtree_bytes, size_t mesh_bytes)
+    {
+        memory_usage_.point_store = (point_positions_.capacity() + point_values_.capacity() + point_errors_.capacity() + point_volumes_.capacity()) * sizeof(double) +
+                                    volume_changed_.capacity() / 8 + on_boundary_.capacity();
+        memory_usage_.triangulation = triangulation_bytes(delaunay_);
+        memory_usage_.scratch_triangulation = triangulation_bytes(lloyd_delaunay_);
+        memory_usage_.point_index = point_index_ ? point_index_->memory_bytes() : 0;
+        memory_usage_.kdtree = std::max(memory_usage_.kdtree, kdtree_bytes);
+        memory_usage_.output_meshes = std::max(memory_usage_.output_meshes, mesh_bytes);
+        memory_usage_.peak = std::max(memory_usage_.peak, memory_usage_.total() + kdtree_bytes + mesh_bytes);
+    }
+
+    void MCMT::compact()
+    {
+        delete lloyd_delaunay_;
+        lloyd_delaunay_ = nullptr;
+        point_index_.reset();
+        point_positions_.shrink_to_fit();
+        point_values_.shrink_to_fit();
+        point_errors_.shrink_to_fit();
+        point_volumes_.shrink_to_fit();
+        volume_changed_.shrink_to_fit();
+        on_boundary_.shrink_to_fit();
+        track_memory();
+    }
+
+    void MCMT::check_memory_budget(size_t extra_bytes)
+    {
+        if (memory_budget_ == 0)
+            return;
+        track_memory();
+        if (memory_usage_.total() + extra_bytes <= memory_budget_)
+            return;
+        compact();
+        if (memory_usage_.total() + extra_bytes > memory_budget_)
+        {
+            throw std::runtime_error("MCMT memory budget exceeded: " + std::to_string(memory_usage_.total() + extra_bytes) +
+                                     " bytes needed, budget is " + std::to_string(memory_budget_) + " bytes");
+        }
+    }
+
+    void MCMT::compute_delaunay(PeriodicDelaunay3d *delaunay, index_t nb_vertices, const double *vertices)
+    {
+        ScopedTimer timer(stats(), trace(), STAGE_DELAUNAY);
+        delaunay->set_vertices(nb_vertices, vertices);
+        delaunay->compute();
+        count(COUNTER_TETS_CREATED, delaunay->nb_finite_cells());
+        track_memory();
     }
 
     void MCMT::clear()
     {
         delete delaunay_;
         num_point_visited_ = 0;
+        point_index_.reset();
         point_positions_.clear();
         point_values_.clear();
         point_errors_.clear();
+        point_volumes_.clear();
+        volume_changed_.clear();
+        on_boundary_.clear();
+        if (!fixed_domain_)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                domain_min_[c] = std::numeric_limits<double>::max();
+                domain_max_[c] = -std::numeric_limits<double>::max();
+            }
+        }
 
         // create new delaunay
-        delaunay_ = new PeriodicDelaunay3d(periodic_, 1.0);
-        if (!periodic_)
+        delaunay_ = create_delaunay();
+    }
+
+    void MCMT::save_state(const std::string &filename) const
+    {
+        StateHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, state_magic, sizeof(state_magic));
+        header.version = state_version;
+        header.flags = (periodic_ ? STATE_PERIODIC : 0) | (fixed_domain_ ? STATE_FIXED_DOMAIN : 0) | STATE_INSERTION_ORDER;
+        header.boundary_mode = uint32_t(boundary_mode_);
+        header.num_points = nb_points();
+        header.num_point_visited = num_point_visited_;
+        header.num_volumes = point_volumes_.size();
+        for (int c = 0; c < 3; c++)
+        {
+            header.domain_min[c] = domain_min_[c];
+            header.domain_max[c] = domain_max_[c];
+        }
+        header.period = period_;
+
+        // geogram cannot restore a triangulation from its tables, the points
+        // are saved in BRIO order instead so that loading skips the reordering
+        std::vector<index_t> order = insertion_order(point_positions_, point_volumes_.size(), num_point_visited_);
+        std::vector<double> positions = gather(point_positions_, order, 3);
+        std::vector<double> values = gather(point_values_, order, 1);
+        std::vector<double> errors = gather(point_errors_, order, 1);
+        std::vector<double> volumes = gather(point_volumes_, order, 1);
+        std::vector<char> flags(padded(volume_changed_.size()), 0);
+        for (size_t i = 0; i < volume_changed_.size(); i++)
+        {
+            flags[i] = volume_changed_[order[i]];
+        }
+
+        // written to a temporary file and renamed, so that a crash while
+        // saving keeps the previous checkpoint
+        std::string temporary = filename + ".tmp";
+        std::FILE *file = std::fopen(temporary.c_str(), "wb");
+        if (!file)
+        {
+            throw std::runtime_error("MCMT::save_state: cannot open " + temporary);
+        }
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && std::fwrite(positions.data(), sizeof(double), positions.size(), file) == positions.size();
+        ok = ok && std::fwrite(values.data(), sizeof(double), values.size(), file) == values.size();
+        ok = ok && std::fwrite(errors.data(), sizeof(double), errors.size(), file) == errors.size();
+        ok = ok && std::fwrite(volumes.data(), sizeof(double), volumes.size(), file) == volumes.size();
+        ok = ok && std::fwrite(flags.data(), 1, flags.size(), file) == flags.size();
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok || std::rename(temporary.c_str(), filename.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("MCMT::save_state: cannot write " + filename);
+        }
+    }
+
+    void MCMT::load_state(const std::string &filename)
+    {
+        std::FILE *file = std::fopen(filename.c_str(), "rb");
+        if (!file)
+        {
+            throw std::runtime_error("MCMT::load_state: cannot open " + filename);
+        }
+        StateHeader header;
+        bool ok = std::fread(&header, sizeof(header), 1, file) == 1;
+        if (!ok || std::memcmp(header.magic, state_magic, sizeof(state_magic)) != 0 || header.version == 0 || header.version > state_version ||
+            header.num_point_visited > header.num_points || header.num_volumes > header.num_points ||
+            header.boundary_mode > uint32_t(BOUNDARY_REFLECT))
+        {
+            std::fclose(file);
+            throw std::runtime_error("MCMT::load_state: " + filename + " is not an MCMT state file of version <= " + std::to_string(state_version));
+        }
+
+        // the counts of the header must match the file size before anything
+        // is allocated from them
+        size_t n = header.num_points;
+        long end = std::fseek(file, 0, SEEK_END) == 0 ? std::ftell(file) : -1;
+        uint64_t payload = end >= long(sizeof(header)) ? uint64_t(end) - sizeof(header) : 0;
+        if (end < long(sizeof(header)) || n > payload / (5 * sizeof(double)) ||
+            payload != 5 * sizeof(double) * n + sizeof(double) * header.num_volumes + padded(header.num_volumes) ||
+            std::fseek(file, sizeof(header), SEEK_SET) != 0)
+        {
+            std::fclose(file);
+            throw std::runtime_error("MCMT::load_state: the size of " + filename + " does not match its header");
+        }
+
+        std::vector<double> positions(n * 3), values(n), errors(n), volumes(header.num_volumes);
+        std::vector<char> flags(padded(header.num_volumes));
+        ok = std::fread(positions.data(), sizeof(double), positions.size(), file) == positions.size();
+        ok = ok && std::fread(values.data(), sizeof(double), n, file) == n;
+        ok = ok && std::fread(errors.data(), sizeof(double), n, file) == n;
+        ok = ok && std::fread(volumes.data(), sizeof(double), volumes.size(), file) == volumes.size();
+        ok = ok && std::fread(flags.data(), 1, flags.size(), file) == flags.size();
+        std::fclose(file);
+        if (!ok)
+        {
+            throw std::runtime_error("MCMT::load_state: " + filename + " is truncated");
+        }
+
+        periodic_ = header.flags & STATE_PERIODIC;
+        fixed_domain_ = header.flags & STATE_FIXED_DOMAIN;
+        boundary_mode_ = BoundaryMode(header.boundary_mode);
+        period_ = header.period;
+        for (int c = 0; c < 3; c++)
+        {
+            domain_min_[c] = header.domain_min[c];
+            domain_max_[c] = header.domain_max[c];
+        }
+        delete lloyd_delaunay_;
+        lloyd_delaunay_ = nullptr;
+
+        point_index_.reset();
+        point_positions_.swap(positions);
+        point_values_.swap(values);
+        point_errors_.swap(errors);
+        point_volumes_.swap(volumes);
+        volume_changed_.assign(flags.begin(), flags.begin() + header.num_volumes);
+        on_boundary_.clear();
+        num_point_visited_ = int(header.num_point_visited);
+
+        delete delaunay_;
+        // geogram's own reordering stays on: the saved order is only sorted per
+        // segment, one global BRIO of all the points inserts faster
+        delaunay_ = create_delaunay();
+        if (nb_points() > 0)
         {
-            delaunay_->set_keeps_infinite(true);
+            compute_delaunay(delaunay_, nb_points(), point_positions_.data());
         }
+        update_domain(0);
     }
 
     std::vector<double> MCMT::get_grid_points()
     {
         std::vector<double> grid_points;
-        for (index_t v = 0; v < delaunay_->nb_vertices(); v++)
+        for (index_t v = 0; v < nb_points(); v++)
         {
             grid_points.push_back(delaunay_->vertex_ptr(v)[0]);
             grid_points.push_back(delaunay_->vertex_ptr(v)[1]);
@@ -47,24 +424,295 @@ namespace GEO
         return grid_points;
     }
 
-    std::vector<int> MCMT::get_grids()
+    std::vector<int> MCMT::get_grids(const GridClip &clip)
+    {
+        size_t nb_tets = count_grids(clip);
+        check_memory_budget(nb_tets * 4 * sizeof(int));
+        std::vector<int> v_indices(nb_tets * 4);
+        copy_grids(v_indices.data(), nb_tets, clip);
+        track_memory(0, v_indices.capacity() * sizeof(int));
+        return v_indices;
+    }
+
+    size_t MCMT::count_grids(const GridClip &clip)
+    {
+        return count_grid_blocks(0, delaunay_->nb_finite_cells(), clip, clip_points(clip)).back();
+    }
+
+    size_t MCMT::copy_grids(int *tets, size_t capacity, const GridClip &clip)
+    {
+        index_t nb_cells = delaunay_->nb_finite_cells();
+        std::vector<char> inside = clip_points(clip);
+        std::vector<size_t> offsets = count_grid_blocks(0, nb_cells, clip, inside);
+        if (offsets.back() > capacity)
+        {
+            throw std::runtime_error("MCMT::copy_grids: " + std::to_string(offsets.back()) + " tets do not fit in " + std::to_string(capacity));
+        }
+        fill_grid_blocks(0, nb_cells, offsets, clip, inside, tets);
+        return offsets.back();
+    }
+
+    void MCMT::stream_grids(const std::function<void(const int *, size_t)> &sink, const GridClip &clip, size_t block_cells)
+    {
+        index_t nb_cells = delaunay_->nb_finite_cells();
+        std::vector<char> inside = clip_points(clip);
+        block_cells = std::max<size_t>(block_cells, 1);
+        std::vector<int> block;
+        for (index_t begin = 0; begin < nb_cells; begin = index_t(std::min<size_t>(nb_cells, begin + block_cells)))
+        {
+            index_t end = index_t(std::min<size_t>(nb_cells, begin + block_cells));
+            std::vector<size_t> offsets = count_grid_blocks(begin, end, clip, inside);
+            if (offsets.back() == 0)
+                continue;
+            block.resize(offsets.back() * 4);
+            fill_grid_blocks(begin, end, offsets, clip, inside, block.data());
+            sink(block.data(), offsets.back());
+        }
+    }
+
+    void MCMT::save_grids(const std::string &filename, const GridClip &clip)
+    {
+        std::FILE *file = std::fopen(filename.c_str(), "wb");
+        if (!file)
+        {
+            throw std::runtime_error("MCMT::save_grids: cannot open " + filename);
+        }
+        bool ok = true;
+        stream_grids([&](const int *tets, size_t num_tets)
+                     { ok = ok && std::fwrite(tets, sizeof(int) * 4, num_tets, file) == num_tets; },
+                     clip);
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok)
+        {
+            throw std::runtime_error("MCMT::save_grids: cannot write " + filename);
+        }
+    }
+
+    std::vector<char> MCMT::clip_points(const GridClip &clip) const
+    {
+        std::vector<char> inside(nb_points());
+        tbb::parallel_for(tbb::blocked_range<index_t>(0, nb_points()), [&](tbb::blocked_range<index_t> r)
+                          {
+                              for (index_t i = r.begin(); i < r.end(); i++)
+                              {
+                                  inside[i] = clip.contains(point_positions_.data() + i * 3);
+                              }
+                          });
+        return inside;
+    }
+
+    bool MCMT::keeps_grid_tet(index_t t, const GridClip &clip, const std::vector<char> &inside) const
+    {
+        if (crosses_period(t))
+            return false;
+        int num_inside = 0;
+        double min_value = std::numeric_limits<double>::max();
+        double max_value = -std::numeric_limits<double>::max();
+        for (index_t lv = 0; lv < 4; ++lv)
+        {
+            index_t v = delaunay_->cell_vertex(t, lv);
+            num_inside += inside[v];
+            min_value = std::min(min_value, point_values_[v]);
+            max_value = std::max(max_value, point_values_[v]);
+        }
+        if (clip.whole_tets ? num_inside < 4 : num_inside == 0)
+            return false;
+        return !clip.iso_crossing || (min_value < clip.iso_value && max_value > clip.iso_value);
+    }
+
+    std::vector<size_t> MCMT::count_grid_blocks(index_t begin, index_t end, const GridClip &clip, const std::vector<char> &inside) const
+    {
+        index_t nb_blocks = end > begin ? (end - begin + grid_block_size - 1) / grid_block_size : 0;
+        std::vector<size_t> offsets(nb_blocks + 1, 0);
+        tbb::parallel_for(index_t(0), nb_blocks, [&](index_t b)
+                          {
+                              size_t kept = 0;
+                              for (index_t i = begin + b * grid_block_size; i < std::min(end, begin + (b + 1) * grid_block_size); i++)
+                              {
+                                  kept += keeps_grid_tet(i, clip, inside);
+                              }
+                              offsets[b + 1] = kept;
+                          });
+        for (index_t b = 0; b < nb_blocks; b++)
+        {
+            offsets[b + 1] += offsets[b];
+        }
+        return offsets;
+    }
+
+    void MCMT::fill_grid_blocks(index_t begin, index_t end, const std::vector<size_t> &offsets, const GridClip &clip,
+                                const std::vector<char> &inside, int *tets) const
+    {
+        tbb::parallel_for(index_t(0), index_t(offsets.size() - 1), [&](index_t b)
+                          {
+                              int *tet = tets + 4 * offsets[b];
+                              for (index_t i = begin + b * grid_block_size; i < std::min(end, begin + (b + 1) * grid_block_size); i++)
+                              {
+                                  if (!keeps_grid_tet(i, clip, inside))
+                                      continue;
+                                  for (index_t lv = 0; lv < 4; ++lv)
+                                  {
+                                      *tet++ = int(delaunay_->cell_vertex(i, lv));
+                                  }
+                              }
+                          });
+    }
+
+    void MCMT::set_domain(const double *min_corner, const double *max_corner)
     {
-        std::vector<int> v_indices;
+        fixed_domain_ = true;
+        for (int c = 0; c < 3; c++)
+        {
+            domain_min_[c] = min_corner[c];
+            domain_max_[c] = max_corner[c];
+        }
+        if (periodic_)
+        {
+            period_ = check_periodic_domain();
+        }
+        update_domain(0);
+    }
+
+    void MCMT::set_periodic(bool periodic)
+    {
+        if (periodic == periodic_)
+            return;
+        if (nb_points() > 0)
+        {
+            throw std::runtime_error("MCMT::set_periodic must be called before adding points");
+        }
+        if (periodic)
+        {
+            period_ = check_periodic_domain();
+        }
+        periodic_ = periodic;
+
+        delete delaunay_;
+        delaunay_ = create_delaunay();
+        delete lloyd_delaunay_;
+        lloyd_delaunay_ = nullptr;
+    }
+
+    double MCMT::check_periodic_domain() const
+    {
+        // PeriodicDelaunay3d works on [0, period]^3
+        if (!fixed_domain_)
+        {
+            throw std::runtime_error("periodic mode needs a domain set with set_domain");
+        }
+        double period = domain_max_[0];
+        for (int c = 0; c < 3; c++)
+        {
+            if (domain_min_[c] != 0.0 || domain_max_[c] != period)
+            {
+                throw std::runtime_error("periodic mode needs a cubic domain [0, L]^3");
+            }
+        }
+        if (!(period > 0.0))
+        {
+            throw std::runtime_error("periodic mode needs a non-empty domain");
+        }
+        return period;
+    }
 
-        for (int i = 0; i < delaunay_->nb_finite_cells(); i++)
+    void MCMT::constrain_point(double *p) const
+    {
+        for (int c = 0; c < 3; c++)
         {
-            for (index_t lv = 0; lv < 4; ++lv)
+            double x = p[c];
+            if (periodic_)
+            {
+                x -= period_ * std::floor(x / period_);
+                // rounding of x / period_ may land exactly on the period
+                x = x < period_ ? x : 0.0;
+            }
+            else
             {
-                int v = delaunay_->cell_vertex(i, lv);
-                double x = delaunay_->vertex_ptr(v)[0];
-                v_indices.push_back(int(v));
+                if (boundary_mode_ == BOUNDARY_REFLECT)
+                {
+                    x = x < domain_min_[c] ? 2.0 * domain_min_[c] - x : x;
+                    x = x > domain_max_[c] ? 2.0 * domain_max_[c] - x : x;
+                }
+                // reflecting over more than the domain width still clamps
+                x = std::min(std::max(x, domain_min_[c]), domain_max_[c]);
             }
+            p[c] = x;
         }
-        return v_indices;
+    }
+
+    double MCMT::difference(double a, double b) const
+    {
+        double diff = a - b;
+        if (periodic_)
+        {
+            diff -= period_ * std::round(diff / period_);
+        }
+        return diff;
+    }
+
+    void MCMT::get_domain(double *min_corner, double *max_corner) const
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            min_corner[c] = domain_min_[c];
+            max_corner[c] = domain_max_[c];
+        }
+    }
+
+    void MCMT::update_domain(index_t first_point)
+    {
+        bool changed = first_point == 0;
+        if (!fixed_domain_ && !periodic_)
+        {
+            for (index_t i = first_point; i < nb_points(); i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    double x = point_positions_[i * 3 + c];
+                    if (x < domain_min_[c])
+                    {
+                        domain_min_[c] = x;
+                        changed = true;
+                    }
+                    if (x > domain_max_[c])
+                    {
+                        domain_max_[c] = x;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        // flags of the existing points only go stale when the domain grows
+        on_boundary_.resize(nb_points());
+        TraceRecorder *tracer = trace();
+        tbb::parallel_for(tbb::blocked_range<index_t>(changed ? 0 : first_point, nb_points()),
+                          [&](tbb::blocked_range<index_t> ti)
+                          {
+                              TraceScope task(tracer, "update_domain_task", ti.size());
+                              for (index_t i = ti.begin(); i < ti.end(); i++)
+                              {
+                                  bool on_boundary = false;
+                                  // a periodic domain has no boundary
+                                  for (int c = 0; c < 3 && !periodic_; c++)
+                                  {
+                                      double x = point_positions_[i * 3 + c];
+                                      if (x - domain_min_[c] < 1e-6 || domain_max_[c] - x < 1e-6)
+                                      {
+                                          on_boundary = true;
+                                      }
+                                  }
+                                  on_boundary_[i] = on_boundary;
+                              }
+                          });
     }
 
     void MCMT::add_points(int num_points, double *point_positions, double *point_values)
     {
+        ScopedTimer timer(stats(), trace(), STAGE_ADD_POINTS);
+        check_memory_budget(size_t(num_points) * bytes_per_new_point);
+        count(COUNTER_POINTS_INSERTED, num_points);
+        count(COUNTER_SDF_VALUES, num_points);
         num_point_visited_ = 0;
         int current_num_points = point_positions_.size() / 3;
         for (index_t i = 0; i < num_points; i++)
@@ -72,30 +720,21 @@ namespace GEO
             point_positions_.push_back(point_positions[i * 3]);
             point_positions_.push_back(point_positions[i * 3 + 1]);
             point_positions_.push_back(point_positions[i * 3 + 2]);
+            if (periodic_)
+            {
+                constrain_point(&point_positions_[point_positions_.size() - 3]);
+            }
             point_values_.push_back(point_values[i]);
             point_errors_.push_back(1 / (abs(point_values[i]) + 1e-6));
         }
         delete delaunay_;
-        delaunay_ = new PeriodicDelaunay3d(periodic_, 1.0);
-        if (!periodic_)
-        {
-            delaunay_->set_keeps_infinite(true);
-        }
-        delaunay_->set_vertices(point_positions_.size() / 3, point_positions_.data());
-        delaunay_->compute();
+        delaunay_ = create_delaunay();
+        compute_delaunay(delaunay_, nb_points(), point_positions_.data());
 
-        for (int i = 0; i < point_positions_.size(); i++)
-        {
-            if (point_positions_[i] > max_bound)
-            {
-                max_bound = point_positions_[i];
-            }
-            if (point_positions_[i] < min_bound)
-            {
-                min_bound = point_positions_[i];
-            }
-        }
+        update_domain(current_num_points);
 
+        ScopedTimer volume_timer(stats(), trace(), STAGE_CELL_VOLUMES);
+        count(COUNTER_CELLS_RECOMPUTED, nb_points() - current_num_points);
         for (int i = current_num_points; i < point_positions_.size() / 3; i++)
         {
             ConvexCell C;
@@ -115,7 +754,11 @@ namespace GEO
                 for (int lv = 0; lv < 4; lv++)
                 {
                     int point_id = delaunay_->cell_vertex(*it, lv);
-                    if (point_id == -1 || point_id == i)
+                    if (point_id == -1)
+                        continue;
+                    // periodic copies are numbered after the real vertices
+                    point_id = point_id % int(nb_points());
+                    if (point_id == i)
                         continue;
                     volume_changed_[point_id] = true;
                 }
@@ -131,6 +774,7 @@ namespace GEO
 
                 get_cell(i, C, W);
                 point_volumes_[i] = C.volume();
+                count(COUNTER_CELLS_RECOMPUTED, 1);
             }
         }
         // exit(0);
@@ -138,7 +782,10 @@ namespace GEO
 
     void MCMT::add_mid_points(int num_points, double* point_positions, double* point_values)
     {
-        auto start = std::chrono::high_resolution_clock::now();
+        ScopedTimer timer(stats(), trace(), STAGE_ADD_MID_POINTS);
+        check_memory_budget(size_t(num_points) * bytes_per_new_point);
+        count(COUNTER_POINTS_INSERTED, num_points);
+        count(COUNTER_SDF_VALUES, num_points);
         num_point_visited_ = point_positions_.size() / 3;
         size_t old_positions_size = point_positions_.size();
         size_t old_values_size = point_values_.size();
@@ -148,9 +795,6 @@ namespace GEO
         point_values_.resize(old_values_size + num_points);
         point_errors_.resize(old_values_size + num_points);
 
-        double max_b = max_bound;
-        double min_b = min_bound;
-
         for (index_t i = 0; i < num_points; ++i)
         {
             double x = point_positions[i * 3];
@@ -162,47 +806,23 @@ namespace GEO
             point_positions_[idx] = x;
             point_positions_[idx + 1] = y;
             point_positions_[idx + 2] = z;
+            if (periodic_)
+            {
+                constrain_point(&point_positions_[idx]);
+            }
 
             point_values_[old_values_size + i] = point_values[i];
             point_errors_[old_values_size + i] = 1 / (std::abs(point_values[i]) + 1e-6);
-
-            // Optimize bound updates
-            if (x > max_b) max_b = x;
-            if (y > max_b) max_b = y;
-            if (z > max_b) max_b = z;
-
-            if (x < min_b) min_b = x;
-            if (y < min_b) min_b = y;
-            if (z < min_b) min_b = z;
         }
 
-        auto end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> diff = end - start;
-        diff = diff * 1000;
-        std::cout << "add_mid_points: Loop Time: " << diff.count() << " ms\n";
-
         // Update bounds
-        max_bound = max_b;
-        min_bound = min_b;
+        update_domain(old_values_size);
 
         delete delaunay_;
-        delaunay_ = new PeriodicDelaunay3d(periodic_, 1.0);
-
-        if (!periodic_)
-        {
-            delaunay_->set_keeps_infinite(true);
-        }
+        delaunay_ = create_delaunay();
 
-        // Set initial vertices
-        delaunay_->set_vertices(point_positions_.size() / 3, point_positions_.data());
         // Compute the updated triangulation
-        start = std::chrono::high_resolution_clock::now();
-        delaunay_->compute();
-
-        end = std::chrono::high_resolution_clock::now();
-        diff = end - start;
-        diff = diff * 1000;
-        std::cout << "add_mid_points: delaunay computation time: " << diff.count() << " ms\n";
+        compute_delaunay(delaunay_, nb_points(), point_positions_.data());
     }
 
 
@@ -223,84 +843,205 @@ namespace GEO
         return std::vector<double>{p1_x + t * (p2_x - p1_x), p1_y + t * (p2_y - p1_y), p1_z + t * (p2_z - p1_z)};
     }
 
-    std::vector<double> MCMT::sample_points_rejection(int num_points, double min_bound, double max_bound)
+    std::vector<MCMT::EnvelopeBlock> MCMT::build_density_envelope(const KDTree &tree, const double *min_corner, const double *max_corner)
     {
-        // compute density
-        KDTree tree = KDTree(point_positions_.size() / 3, point_positions_.data(), point_errors_.data());
-        int current_num_points = 0;
-        int batch_size = 4096;
-        std::vector<double> sampled_points;
-        while (current_num_points < num_points)
+        const int base_res = 8;
+        const int num_refine_levels = 4;
+        const size_t max_blocks = 1 << 18;
+
+        auto compute_bounds = [&](std::vector<EnvelopeBlock> &blocks, size_t begin)
         {
-            std::vector<double> new_points;
-            new_points.reserve(batch_size * 3);
-            for (int i = 0; i < batch_size * 3; i++)
-            {
-                new_points.push_back(Numeric::random_float64() * (max_bound - min_bound) + min_bound);
-            }
+            TraceRecorder *tracer = trace();
+            tbb::parallel_for(tbb::blocked_range<size_t>(begin, blocks.size()),
+                              [&](tbb::blocked_range<size_t> bi)
+                              {
+                                  TraceScope task(tracer, "envelope_task", bi.size());
+                                  for (size_t b = bi.begin(); b < bi.end(); b++)
+                                  {
+                                      EnvelopeBlock &block = blocks[b];
+                                      double center[3];
+                                      double radius = 0;
+                                      for (int c = 0; c < 3; c++)
+                                      {
+                                          center[c] = block.min_corner[c] + 0.5 * block.size[c];
+                                          radius += 0.25 * block.size[c] * block.size[c];
+                                      }
+                                      // children inherit the parent bound, keep the tighter one
+                                      block.bound = std::min(block.bound, tree.max_density(center, std::sqrt(radius)));
+                                  }
+                              });
+        };
+
+        // coarse uniform level
+        // a cube missing the domain has an inverted extent: clamp it and return no blocks
+        double base_size[3];
+        for (int c = 0; c < 3; c++)
+        {
+            base_size[c] = std::max(0.0, max_corner[c] - min_corner[c]) / base_res;
+        }
+        std::vector<EnvelopeBlock> blocks;
+        if (base_size[0] == 0.0 || base_size[1] == 0.0 || base_size[2] == 0.0)
+            return blocks;
+        blocks.reserve(base_res * base_res * base_res);
+        for (int i = 0; i < base_res; i++)
+        {
+            for (int j = 0; j < base_res; j++)
+            {
+                for (int k = 0; k < base_res; k++)
+                {
+                    EnvelopeBlock block;
+                    block.min_corner[0] = min_corner[0] + i * base_size[0];
+                    block.min_corner[1] = min_corner[1] + j * base_size[1];
+                    block.min_corner[2] = min_corner[2] + k * base_size[2];
+                    block.size[0] = base_size[0];
+                    block.size[1] = base_size[1];
+                    block.size[2] = base_size[2];
+                    block.bound = std::numeric_limits<double>::max();
+                    blocks.push_back(block);
+                }
+            }
+        }
+        compute_bounds(blocks, 0);
+
+        // octree refinement of the blocks holding more than their share of the envelope mass
+        for (int level = 0; level < num_refine_levels; level++)
+        {
+            double total_mass = 0;
+            for (size_t b = 0; b < blocks.size(); b++)
+            {
+                total_mass += blocks[b].bound * blocks[b].volume();
+            }
+            double mean_mass = total_mass / blocks.size();
+
+            std::vector<EnvelopeBlock> kept;
+            std::vector<EnvelopeBlock> children;
+            for (size_t b = 0; b < blocks.size(); b++)
+            {
+                const EnvelopeBlock &block = blocks[b];
+                double mass = block.bound * block.volume();
+                if (mass <= mean_mass || kept.size() + children.size() + (blocks.size() - b) + 7 > max_blocks)
+                {
+                    kept.push_back(block);
+                    continue;
+                }
+                for (int o = 0; o < 8; o++)
+                {
+                    EnvelopeBlock child = block;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        child.size[c] = 0.5 * block.size[c];
+                        child.min_corner[c] += (o & (1 << c)) ? child.size[c] : 0.0;
+                    }
+                    children.push_back(child);
+                }
+            }
+            if (children.empty())
+                break;
+
+            size_t num_kept = kept.size();
+            kept.insert(kept.end(), children.begin(), children.end());
+            blocks.swap(kept);
+            compute_bounds(blocks, num_kept);
+        }
+        return blocks;
+    }
+
+    void MCMT::interpolate(const double *point1, const double *point2, double sd1, double sd2, double *point) const
+    {
+        double t = sd1 / ((sd1 - sd2));
+        if (std::abs(sd1 - sd2) < 1e-6)
+        {
+            t = 0.5;
+        }
+        point[0] = point1[0] + t * (point2[0] - point1[0]);
+        point[1] = point1[1] + t * (point2[1] - point1[1]);
+        point[2] = point1[2] + t * (point2[2] - point1[2]);
+    }
+
+    std::vector<double> MCMT::sample_points_rejection(int num_points, double min_bound, double max_bound)
+    {
+        ScopedTimer timer(stats(), trace(), STAGE_SAMPLING);
+        sampling_stats_ = SamplingStats();
+        std::vector<double> sampled_points;
+        if (num_points <= 0 || point_positions_.empty())
+            return sampled_points;
+
+        // compute density
+        check_memory_budget(size_t(nb_points()) * kdtree_bytes_per_point);
+        KDTree tree(point_positions_.size() / 3, point_positions_.data(), point_errors_.data());
+        track_memory(tree.memory_bytes());
+
+        // sample the cube [min_bound, max_bound]^3, restricted to the domain box when one was set
+        double min_corner[3] = {min_bound, min_bound, min_bound};
+        double max_corner[3] = {max_bound, max_bound, max_bound};
+        if (fixed_domain_)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                min_corner[c] = std::max(min_corner[c], domain_min_[c]);
+                max_corner[c] = std::min(max_corner[c], domain_max_[c]);
+            }
+        }
+
+        // propose per block proportionally to bound * volume, accept against the block bound
+        std::vector<EnvelopeBlock> blocks = build_density_envelope(tree, min_corner, max_corner);
+        if (blocks.empty())
+            return sampled_points;
+        std::vector<double> cumsum;
+        cumsum.reserve(blocks.size());
+        double current_sum = 0;
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            current_sum += blocks[b].bound * blocks[b].volume();
+            cumsum.push_back(current_sum);
+        }
+
+        int current_num_points = 0;
+        int batch_size = 4096;
+        sampled_points.reserve(num_points * 3);
+        std::vector<double> new_points(batch_size * 3);
+        std::vector<int> new_blocks(batch_size);
+        while (current_num_points < num_points)
+        {
+            for (int i = 0; i < batch_size; i++)
+            {
+                auto upper = std::upper_bound(cumsum.begin(), cumsum.end(), Numeric::random_float64() * current_sum);
+                int block_index = std::min(int(std::distance(cumsum.begin(), upper)), int(blocks.size()) - 1);
+                const EnvelopeBlock &block = blocks[block_index];
+                new_blocks[i] = block_index;
+                for (int c = 0; c < 3; c++)
+                {
+                    new_points[i * 3 + c] = block.min_corner[c] + Numeric::random_float64() * block.size[c];
+                }
+            }
             std::vector<double> density = tree.compute_density(batch_size, new_points.data());
-            double max_density = *std::max_element(density.begin(), density.end());
             for (int i = 0; i < batch_size; i++)
             {
-                double threshold = Numeric::random_float64() * max_density;
+                sampling_stats_.num_proposed++;
+                double threshold = Numeric::random_float64() * blocks[new_blocks[i]].bound;
                 if (density[i] > threshold)
                 {
                     sampled_points.push_back(new_points[i * 3]);
                     sampled_points.push_back(new_points[i * 3 + 1]);
                     sampled_points.push_back(new_points[i * 3 + 2]);
                     current_num_points++;
+                    sampling_stats_.num_accepted++;
                     if (current_num_points == num_points)
                         break;
                 }
             }
         }
+        sampling_stats_.num_envelope_blocks = blocks.size();
+        sampling_stats_.acceptance_rate = double(sampling_stats_.num_accepted) / double(sampling_stats_.num_proposed);
         return sampled_points;
     }
 
-    double MCMT::tetrahedronVolume(const std::vector<double> &coordinates)
-    {
-        // Check if there are enough coordinates
-        if (coordinates.size() != 12)
-        {
-            std::cerr << "Error: Insufficient coordinates provided." << std::endl;
-            return 0.0; // Return an appropriate value
-        }
-
-        // Extract coordinates of points A, B, C, and D
-        double Ax = coordinates[0], Ay = coordinates[1], Az = coordinates[2];
-        double Bx = coordinates[3], By = coordinates[4], Bz = coordinates[5];
-        double Cx = coordinates[6], Cy = coordinates[7], Cz = coordinates[8];
-        double Dx = coordinates[9], Dy = coordinates[10], Dz = coordinates[11];
-
-        // Vector from A to B
-        double ABx = Bx - Ax, ABy = By - Ay, ABz = Bz - Az;
-
-        // Vector from A to C
-        double ACx = Cx - Ax, ACy = Cy - Ay, ACz = Cz - Az;
-
-        // Vector from A to D
-        double ADx = Dx - Ax, ADy = Dy - Ay, ADz = Dz - Az;
-
-        // Cross product of AC and AD
-        double crossProduct_i = ACy * ADz - ACz * ADy;
-        double crossProduct_j = ACz * ADx - ACx * ADz;
-        double crossProduct_k = ACx * ADy - ACy * ADx;
-
-        // Dot product of AB and the cross product of AC and AD
-        double dotProduct = ABx * crossProduct_i + ABy * crossProduct_j + ABz * crossProduct_k;
-
-        // Volume calculation
-        double volume = std::abs(dotProduct) / 6.0;
-
-        return volume;
-    }
-
     std::vector<double> MCMT::compute_voronoi_error()
     {
 
         std::vector<double> voronoi_errors;
 
-        for (int i = 0; i < delaunay_->nb_vertices(); i++)
+        for (index_t i = 0; i < nb_points(); i++)
         {
             double volume = point_volumes_[i];
             voronoi_errors.push_back(point_errors_[i] * volume);
@@ -314,24 +1055,38 @@ namespace GEO
         std::vector<double> tet_errors;
         tet_errors.resize(delaunay_->nb_finite_cells());
 
-        tbb::parallel_for(tbb::blocked_range<int>(0, delaunay_->nb_finite_cells()),
+        TraceRecorder *tracer = trace();
+        tbb::parallel_for(tbb::blocked_range<int>(0, delaunay_->nb_finite_cells(), 256),
                           [&](tbb::blocked_range<int> ti)
                           {
+                              TraceScope task(tracer, "tet_error_task", ti.size());
+                              TetBatch batch(ti.size());
                               for (int i = ti.begin(); i < ti.end(); i++)
                               {
                                   double tet_density = 0;
-                                  std::vector<double> point_coordinates;
-
+                                  const double *corners[4];
+                                  if (crosses_period(i))
+                                  {
+                                      // zero volume, keeps the batch aligned with ti
+                                      const double *p = point_positions_.data();
+                                      tet_errors[i] = 0;
+                                      batch.push_back(p, p, p, p);
+                                      continue;
+                                  }
                                   for (index_t lv = 0; lv < 4; ++lv)
                                   {
                                       int v = delaunay_->cell_vertex(i, lv);
                                       tet_density += point_errors_[v];
-                                      for (int c = 0; c < 3; c++)
-                                      {
-                                          point_coordinates.push_back(point_positions_[v * 3 + c]);
-                                      }
+                                      corners[lv] = point_positions_.data() + v * 3;
                                   }
-                                  tet_errors[i] = tet_density * tetrahedronVolume(point_coordinates);
+                                  tet_errors[i] = tet_density;
+                                  batch.push_back(corners[0], corners[1], corners[2], corners[3]);
+                              }
+                              std::vector<double> volumes(batch.size());
+                              batch.volumes(volumes.data());
+                              for (int i = ti.begin(); i < ti.end(); i++)
+                              {
+                                  tet_errors[i] *= volumes[i - ti.begin()];
                               }
                           });
         return tet_errors;
@@ -366,19 +1121,11 @@ namespace GEO
         }
     }
 
-    std::vector<double> MCMT::sample_polytope(int vor_index)
+    void MCMT::get_cell_tets(const ConvexCell &C, const vec3 &apex, TetBatch &tetrahedrons) const
     {
-        // vor_index = 10;
-        ConvexCell C;
-        PeriodicDelaunay3d::IncidentTetrahedra W;
-        get_cell(vor_index, C, W);
-        vec3 g;
-        g = C.barycenter();
-        int index = 1;
+        tetrahedrons.clear();
         // For each vertex of the Voronoi cell
         // Start at 1 (vertex 0 is point at infinity)
-        std::vector<std::vector<double>> tetrahedrons;
-
         for (index_t v = 1; v < C.nb_v(); ++v)
         {
             index_t t = C.vertex_triangle(v);
@@ -397,10 +1144,8 @@ namespace GEO
 
             do
             {
-                std::vector<double> tetrahedron;
-
-                //   Triangulate the Voronoi facet and send the
-                // triangles to OpenGL/GLUP.
+                //   Triangulate the Voronoi facet and connect
+                // the triangles to the apex.
                 if (n == 0)
                 {
                     P[0] = C.triangle_point(VBW::ushort(t));
@@ -412,20 +1157,7 @@ namespace GEO
                 else
                 {
                     P[2] = C.triangle_point(VBW::ushort(t));
-
-                    for (index_t i = 0; i < 3; ++i)
-                    {
-                        tetrahedron.push_back(P[i].x);
-                        tetrahedron.push_back(P[i].y);
-                        tetrahedron.push_back(P[i].z);
-                        // output_mesh << "v " << P[i].x << " " << P[i].y << " " << P[i].z << std::endl;
-                    }
-                    tetrahedron.push_back(g.x);
-                    tetrahedron.push_back(g.y);
-                    tetrahedron.push_back(g.z);
-                    tetrahedrons.push_back(tetrahedron);
-                    // output_mesh << "f " << index << "  " << index + 1 << " " << index + 2 << std::endl;
-                    index += 3;
+                    tetrahedrons.push_back(P[0].data(), P[1].data(), P[2].data(), apex.data());
                     P[1] = P[2];
                 }
                 index_t lv = C.triangle_find_vertex(t, v);
@@ -433,34 +1165,110 @@ namespace GEO
                 ++n;
             } while (t != C.vertex_triangle(v));
         }
-        std::vector<double> tetrahedron_volumes;
-        for (int i = 0; i < tetrahedrons.size(); i++)
+    }
+
+    void MCMT::integrate_cell(const ConvexCell &C, const KDTree *density, TetBatch &tetrahedrons, std::vector<double> &volumes, double &mass, vec3 &centroid,
+                              const double *site, double *energy) const
+    {
+        // fan of tets around the barycenter, density taken at each tet centroid
+        // (uniform density when no density is given)
+        vec3 g = C.barycenter();
+        get_cell_tets(C, g, tetrahedrons);
+        volumes.resize(tetrahedrons.size());
+        tetrahedrons.volumes(volumes.data());
+
+        mass = 0;
+        centroid = vec3(0.0, 0.0, 0.0);
+        if (energy)
         {
-            tetrahedron_volumes.push_back(tetrahedronVolume(tetrahedrons[i]));
+            *energy = 0;
         }
+        for (size_t i = 0; i < tetrahedrons.size(); i++)
+        {
+            double tet_centroid[3];
+            for (int c = 0; c < 3; c++)
+            {
+                tet_centroid[c] = 0.25 * (tetrahedrons.coord(0, c)[i] + tetrahedrons.coord(1, c)[i] + tetrahedrons.coord(2, c)[i] + tetrahedrons.coord(3, c)[i]);
+            }
+            double rho = density ? density->density(tet_centroid) : 1.0;
+            double m = rho * volumes[i];
+            mass += m;
+            centroid += vec3(tet_centroid[0], tet_centroid[1], tet_centroid[2]) * m;
 
-        double tet_volume_sum = std::accumulate(tetrahedron_volumes.begin(), tetrahedron_volumes.end(), 0.0);
+            if (energy)
+            {
+                // second moment of the tet about the site:
+                // V / 20 * (sum |y_k|^2 + |sum y_k|^2) with y_k = corner_k - site
+                double sum_sq = 0;
+                double sum[3] = {0, 0, 0};
+                for (int k = 0; k < 4; k++)
+                {
+                    for (int c = 0; c < 3; c++)
+                    {
+                        double y = tetrahedrons.coord(k, c)[i] - site[c];
+                        sum_sq += y * y;
+                        sum[c] += y;
+                    }
+                }
+                *energy += m / 20.0 * (sum_sq + sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+            }
+        }
+        if (mass > 0)
+        {
+            centroid /= mass;
+        }
+        else
+        {
+            centroid = g;
+        }
+    }
 
-        for (int i = 0; i < tetrahedron_volumes.size(); i++)
+    void MCMT::sample_polytope(int vor_index, size_t num_samples, double *points)
+    {
+        ConvexCell C;
+        PeriodicDelaunay3d::IncidentTetrahedra W;
+        get_cell(vor_index, C, W);
+        vec3 g;
+        g = C.barycenter();
+        TetBatch tetrahedrons;
+        get_cell_tets(C, g, tetrahedrons);
+        if (tetrahedrons.size() == 0)
         {
-            tetrahedron_volumes[i] /= tet_volume_sum;
+            for (size_t j = 0; j < num_samples; j++)
+            {
+                points[j * 3] = g.x;
+                points[j * 3 + 1] = g.y;
+                points[j * 3 + 2] = g.z;
+            }
+            return;
         }
+        std::vector<double> cumsum(tetrahedrons.size());
+        tetrahedrons.volumes(cumsum.data());
 
-        std::vector<double> cumsum;
         double current_sum = 0;
-        for (int i = 0; i < tetrahedron_volumes.size(); i++)
+        for (size_t i = 0; i < cumsum.size(); i++)
         {
-            current_sum += tetrahedron_volumes[i];
-            cumsum.push_back(current_sum);
+            current_sum += cumsum[i];
+            cumsum[i] = current_sum;
         }
 
-        auto upper = std::upper_bound(cumsum.begin(), cumsum.end(), Numeric::random_float64());
-        int tet_index = std::distance(cumsum.begin(), upper);
-        return sample_tet(tetrahedrons[tet_index]);
+        // tet and stu triplet of every sample, the batch kernel then places them all
+        std::vector<size_t> tets(num_samples);
+        std::vector<double> stu(num_samples * 3);
+        for (size_t j = 0; j < num_samples; j++)
+        {
+            auto upper = std::upper_bound(cumsum.begin(), cumsum.end(), Numeric::random_float64() * current_sum);
+            tets[j] = std::min(size_t(std::distance(cumsum.begin(), upper)), cumsum.size() - 1);
+            stu[j * 3] = Numeric::random_float64();
+            stu[j * 3 + 1] = Numeric::random_float64();
+            stu[j * 3 + 2] = Numeric::random_float64();
+        }
+        tetrahedrons.sample(num_samples, tets.data(), stu.data(), points);
     }
 
     std::vector<double> MCMT::sample_points_voronoi(const int num_points)
     {
+        ScopedTimer timer(stats(), trace(), STAGE_SAMPLING);
         std::vector<double> voronoi_density = compute_voronoi_error();
 
         double voronoi_density_sum = std::accumulate(voronoi_density.begin(), voronoi_density.end(), 0.0);
@@ -476,1051 +1284,1462 @@ namespace GEO
 
         std::vector<double> cumsum;
         double current_sum = 0;
-        for (int i = 0; i < voronoi_density.size(); i++)
+        for (size_t i = 0; i < voronoi_density.size(); i++)
         {
             current_sum += voronoi_density[i];
             cumsum.push_back(current_sum);
         }
-        tbb::concurrent_vector<std::vector<double>> sample_points;
-        tbb::parallel_for(tbb::blocked_range<int>(0, num_points),
-                          [&](tbb::blocked_range<int> ti)
+
+        // cell of every sample, sorted so that each cell is built once and
+        // fills a contiguous run of the output
+        std::vector<int> cells(num_points);
+        tbb::parallel_for(0, num_points, [&](int i)
                           {
-                              for (int i = ti.begin(); i < ti.end(); i++)
+                              auto upper = std::upper_bound(cumsum.begin(), cumsum.end(), Numeric::random_float64());
+                              cells[i] = std::min(int(std::distance(cumsum.begin(), upper)), int(cumsum.size()) - 1);
+                          });
+        tbb::parallel_sort(cells.begin(), cells.end());
+        std::vector<size_t> runs = MeshCleanup::select(cells.size(), [&](size_t i)
+                                                       { return i == 0 || cells[i] != cells[i - 1]; });
+        runs.push_back(cells.size());
+
+        std::vector<double> sample_points_vec(size_t(num_points) * 3);
+        TraceRecorder *tracer = trace();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, runs.size() - 1),
+                          [&](tbb::blocked_range<size_t> r)
+                          {
+                              TraceScope task(tracer, "voronoi_sample_task", r.size());
+                              for (size_t k = r.begin(); k < r.end(); k++)
                               {
-                                  auto upper = std::upper_bound(cumsum.begin(), cumsum.end(), Numeric::random_float64());
-                                  int voro_index = std::distance(cumsum.begin(), upper);
-                                  std::vector<double> sampled_point = sample_polytope(voro_index);
-                                  // sample_points.push_back(sampled_point[0]);
-                                  // sample_points.push_back(sampled_point[1]);
-                                  // // sample_points.push_back(sampled_point[2]);
-                                  // sample_points[i * 3] = sampled_point[0];
-                                  // sample_points[i * 3 + 1] = sampled_point[1];
-                                  // sample_points[i * 3 + 2] = sampled_point[2];
-                                  sample_points.push_back(std::vector<double>{sampled_point[0], sampled_point[1], sampled_point[2]});
+                                  double *points = sample_points_vec.data() + runs[k] * 3;
+                                  sample_polytope(cells[runs[k]], runs[k + 1] - runs[k], points);
+                                  for (size_t j = runs[k]; j < runs[k + 1]; j++)
+                                  {
+                                      constrain_point(sample_points_vec.data() + j * 3);
+                                  }
                               }
                           });
-        // std::vector<double> sample_points_vec(sample_points.begin(), sample_points.end());
-        std::vector<double> sample_points_vec;
-        for (int i = 0; i < sample_points.size(); i++)
-        {
-            sample_points_vec.push_back(sample_points[i][0]);
-            sample_points_vec.push_back(sample_points[i][1]);
-            sample_points_vec.push_back(sample_points[i][2]);
-        }
         return sample_points_vec;
     }
 
-    std::vector<double> MCMT::sample_tet(std::vector<double> point_positions)
-    {
-        double s = Numeric::random_float64();
-        double t = Numeric::random_float64();
-        double u = Numeric::random_float64();
-        if (s + t > 1.0)
-        {
-            s = 1.0 - s;
-            t = 1.0 - t;
-        }
-        if (t + u > 1.0)
-        {
-            double tmp = u;
-            u = 1.0 - s - t;
-            t = 1.0 - tmp;
-        }
-        else if (s + t + u > 1.0)
-        {
-            double tmp = u;
-            u = s + t + u - 1.0;
-            s = 1 - t - tmp;
-        }
-        double a = 1 - s - t - u;
-
-        double x = a * point_positions[0] + s * point_positions[3] + t * point_positions[6] + u * point_positions[9];
-        double y = a * point_positions[1] + s * point_positions[4] + t * point_positions[7] + u * point_positions[10];
-        double z = a * point_positions[2] + s * point_positions[5] + t * point_positions[8] + u * point_positions[11];
-        return std::vector<double>{x, y, z};
-    }
-
-    std::vector<double> MCMT::compute_face_mid_point(int num_points, const std::vector<double> &points)
-    {
-        double mid_point_x = 0;
-        double mid_point_y = 0;
-        double mid_point_z = 0;
-
-        for (int i = 0; i < num_points; i++)
-        {
-            mid_point_x += points[i * 3];
-            mid_point_y += points[i * 3 + 1];
-            mid_point_z += points[i * 3 + 2];
-        }
-        mid_point_x /= num_points;
-        mid_point_y /= num_points;
-        mid_point_z /= num_points;
-        return std::vector<double>{mid_point_x, mid_point_y, mid_point_z};
-    }
-
     std::vector<double> MCMT::get_mid_points()
     {
-        tbb::concurrent_set<size_t> new_cells;
+        ScopedTimer timer(stats(), trace(), STAGE_MID_POINTS);
         // if there is a bug, roll back...
         if (delaunay_->nb_finite_cells() == 0)
         {
+            point_index_.reset();
             point_positions_ = std::vector<double>(point_positions_.begin(), point_positions_.begin() + num_point_visited_ * 3);
             point_values_ = std::vector<double>(point_values_.begin(), point_values_.begin() + num_point_visited_);
             point_errors_ = std::vector<double>(point_errors_.begin(), point_errors_.begin() + num_point_visited_);
+            on_boundary_.resize(num_point_visited_);
 
             delete delaunay_;
-            delaunay_ = new PeriodicDelaunay3d(periodic_, 1.0);
-            if (!periodic_)
-            {
-                delaunay_->set_keeps_infinite(true);
-            }
-            delaunay_->set_vertices(point_positions_.size() / 3, point_positions_.data());
-            delaunay_->compute();
+            delaunay_ = create_delaunay();
+            compute_delaunay(delaunay_, nb_points(), point_positions_.data());
             return std::vector<double>{};
         }
-
-        tbb::parallel_for(tbb::blocked_range<int>(num_point_visited_, point_positions_.size() / 3),
-                          [&](tbb::blocked_range<int> ti)
+        // incident tets, candidates and mid points of the new vertices
+        check_memory_budget(size_t(nb_points() - num_point_visited_) * bytes_per_new_point);
+
+        // gather the finite tets incident to the new vertices in per-thread
+        // vectors, then sort and deduplicate them so the candidate order does
+        // not depend on scheduling
+        index_t nb_finite_cells = delaunay_->nb_finite_cells();
+        tbb::enumerable_thread_specific<std::vector<index_t>> local_cells;
+        tbb::enumerable_thread_specific<PeriodicDelaunay3d::IncidentTetrahedra> local_W;
+        TraceRecorder *tracer = trace();
+        tbb::parallel_for(tbb::blocked_range<index_t>(num_point_visited_, point_positions_.size() / 3),
+                          [&](tbb::blocked_range<index_t> ti)
                           {
-                              for (int i = ti.begin(); i < ti.end(); i++)
+                              TraceScope task(tracer, "incident_tets_task", ti.size());
+                              std::vector<index_t> &cells = local_cells.local();
+                              PeriodicDelaunay3d::IncidentTetrahedra &W = local_W.local();
+                              for (index_t i = ti.begin(); i < ti.end(); i++)
                               {
-                                  PeriodicDelaunay3d::IncidentTetrahedra W;
                                   delaunay_->get_incident_tets(i, W);
                                   for (auto it = W.begin(); it != W.end(); it++)
                                   {
-                                      if (*it < delaunay_->nb_finite_cells() && *it >= 0)
+                                      if (*it < nb_finite_cells)
                                       {
-                                          bool skip = false;
-                                          for (int lv = 0; lv < 4; lv++)
-                                          {
-                                              int v = delaunay_->cell_vertex(*it, lv);
-                                              if (v == -1)
-                                              {
-                                                  skip = true;
-                                              }
-                                              if (point_positions_[v * 3] - min_bound < 1e-6 || max_bound - point_positions_[v * 3] < 1e-6)
-                                              {
-                                                  skip = true;
-                                              }
-                                              if (point_positions_[v * 3 + 1] - min_bound < 1e-6 || max_bound - point_positions_[v * 3 + 1] < 1e-6)
-                                              {
-                                                  skip = true;
-                                              }
-                                              if (point_positions_[v * 3 + 2] - min_bound < 1e-6 || max_bound - point_positions_[v * 3 + 2] < 1e-6)
-                                              {
-                                                  skip = true;
-                                              }
-                                          }
-                                          if (!skip)
-                                          {
-                                              new_cells.insert(*it);
-                                          }
+                                          cells.push_back(*it);
                                       }
                                   }
                               }
                           });
 
-        std::vector<int> new_cell_ids(new_cells.begin(), new_cells.end());
-        tbb::concurrent_vector<std::vector<double>> sample_points;
-        tbb::parallel_for(tbb::blocked_range<int>(0, new_cell_ids.size()),
-                          [&](tbb::blocked_range<int> ti)
+        size_t num_cells = 0;
+        for (auto it = local_cells.begin(); it != local_cells.end(); ++it)
+        {
+            num_cells += it->size();
+        }
+        std::vector<index_t> new_cell_ids;
+        new_cell_ids.reserve(num_cells);
+        for (auto it = local_cells.begin(); it != local_cells.end(); ++it)
+        {
+            new_cell_ids.insert(new_cell_ids.end(), it->begin(), it->end());
+        }
+        tbb::parallel_sort(new_cell_ids.begin(), new_cell_ids.end());
+        new_cell_ids.erase(std::unique(new_cell_ids.begin(), new_cell_ids.end()), new_cell_ids.end());
+        count(COUNTER_CANDIDATES, new_cell_ids.size());
+
+        // one output slot per candidate, compacted in candidate order
+        std::vector<double> slots(new_cell_ids.size() * 3);
+        std::vector<unsigned char> accepted(new_cell_ids.size(), 0);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, new_cell_ids.size()),
+                          [&](tbb::blocked_range<size_t> ti)
                           {
-						  for(index_t i = ti.begin(); i < ti.end(); i++)
-						  {
-                            index_t t = new_cell_ids[i];
-                            unsigned char index = 0;
-
-							  std::vector<int> tri2v;
-							  for (index_t lv = 0; lv < 4; ++lv)
-							  {
-								  int v = delaunay_->cell_vertex(t, lv);
-								  if (v != -1){
-									  tri2v.push_back(int(v));
+                              TraceScope task(tracer, "mid_point_task", ti.size());
+                              for (size_t i = ti.begin(); i < ti.end(); i++)
+                              {
+                                  index_t t = new_cell_ids[i];
+                                  if (!touches_boundary(t) && compute_mid_point(t, slots.data() + i * 3))
+                                  {
+                                      accepted[i] = 1;
                                   }
-                                if(point_values_[v] < 0){
-                                    index |= (1 << lv);
-                                }
-							  }
-                            if(index == 0x00 || index == 0x0F){
-                                continue;
-                            }
-
-							  std::vector<double> intersection_points;
-							  if (point_values_[tri2v[0]] * point_values_[tri2v[1]] < 0)
-							  {
-                                  std::vector<double> interpolated_point = interpolate(point_positions_.data() + tri2v[0] * 3, point_positions_.data() + tri2v[1] * 3, point_values_[tri2v[0]], point_values_[tri2v[1]]);
-								  intersection_points.insert(intersection_points.end(), interpolated_point.begin(), interpolated_point.end());
-							  }
-							  if (point_values_[tri2v[0]] * point_values_[tri2v[2]] < 0)
-							  {   std::vector<double> interpolated_point = interpolate(point_positions_.data() + tri2v[0] * 3, point_positions_.data() + tri2v[2] * 3, point_values_[tri2v[0]], point_values_[tri2v[2]]);
-								  intersection_points.insert(intersection_points.end(), interpolated_point.begin(), interpolated_point.end());
-							  }
-							  if (point_values_[tri2v[0]] * point_values_[tri2v[3]] < 0)
-							  {   std::vector<double> interpolated_point = interpolate(point_positions_.data() + tri2v[0] * 3, point_positions_.data() + tri2v[3] * 3, point_values_[tri2v[0]], point_values_[tri2v[3]]);
-								  intersection_points.insert(intersection_points.end(), interpolated_point.begin(), interpolated_point.end());
-							  }
-							  if (point_values_[tri2v[1]] * point_values_[tri2v[2]] < 0)
-							  {   std::vector<double> interpolated_point = interpolate(point_positions_.data() + tri2v[1] * 3, point_positions_.data() + tri2v[2] * 3, point_values_[tri2v[1]], point_values_[tri2v[2]]);
-								  intersection_points.insert(intersection_points.end(), interpolated_point.begin(), interpolated_point.end());
-							  }
-							  if (point_values_[tri2v[1]] * point_values_[tri2v[3]] < 0)
-							  {   std::vector<double> interpolated_point = interpolate(point_positions_.data() + tri2v[1] * 3, point_positions_.data() + tri2v[3] * 3, point_values_[tri2v[1]], point_values_[tri2v[3]]);
-								  intersection_points.insert(intersection_points.end(), interpolated_point.begin(), interpolated_point.end());
-							  }
-							  if (point_values_[tri2v[2]] * point_values_[tri2v[3]] < 0)
-							  {   std::vector<double> interpolated_point = interpolate(point_positions_.data() + tri2v[2] * 3, point_positions_.data() + tri2v[3] * 3, point_values_[tri2v[2]], point_values_[tri2v[3]]);
-								  intersection_points.insert(intersection_points.end(), interpolated_point.begin(), interpolated_point.end());
-							  }
-							  if (intersection_points.size() != 0)
-							  { 
-								std::vector<double> mid_point = compute_face_mid_point(intersection_points.size()/3, intersection_points);
-
-                                    bool skip_mid_point=false;
-                                    std::vector<double> point_coordinates;
-                                    double threshold = 1e-12;
-
-
-                                    std::vector<std::vector<int>> tet_indices{{0,1,2},{0,2,3},{0,1,3},{1,2,3}};
-
-                                    for(auto tet_index: tet_indices){
-
-                                        point_coordinates.clear();
-                                        for (int i:tet_index){
-                                            point_coordinates.push_back(point_positions_[tri2v[i]*3]);
-                                            point_coordinates.push_back(point_positions_[tri2v[i]*3+1]);
-                                            point_coordinates.push_back(point_positions_[tri2v[i]*3+2]);
-
-                                        }
-                                        point_coordinates.push_back(mid_point[0]);
-                                        point_coordinates.push_back(mid_point[1]);
-                                        point_coordinates.push_back(mid_point[2]);
-
-                                        double volume = tetrahedronVolume(point_coordinates);
-                                        if (volume < threshold){
-                                            skip_mid_point = true;
-                                        }
-
-                                    }
-
-                                    if(! skip_mid_point){
-                                        sample_points.push_back(mid_point);
-                                    }
-							
-							  }
-						  } });
+                              }
+                          });
 
         std::vector<double> new_points;
-        new_points.resize(sample_points.size() * 3);
-        for (int i = 0; i < sample_points.size(); i++)
+        new_points.reserve(slots.size());
+        for (size_t i = 0; i < new_cell_ids.size(); i++)
         {
-            new_points[i*3] = sample_points[i][0];
-            new_points[i*3+1] = sample_points[i][1];
-            new_points[i*3+2] = sample_points[i][2];
-
+            if (accepted[i])
+            {
+                new_points.insert(new_points.end(), slots.begin() + i * 3, slots.begin() + i * 3 + 3);
+            }
         }
+        count(COUNTER_MID_POINTS, new_points.size() / 3);
         return new_points;
     }
 
-    void MCMT::get_cell(index_t v, ConvexCell &C, PeriodicDelaunay3d::IncidentTetrahedra &W)
+    bool MCMT::touches_boundary(index_t t) const
     {
-        delaunay_->copy_Laguerre_cell_from_Delaunay(v, C, W);
-        if (!periodic_)
-        {
-            C.clip_by_plane(vec4(1.0, 0.0, 0.0, max_bound));
-            C.clip_by_plane(vec4(-1.0, 0.0, 0.0, -min_bound));
-            C.clip_by_plane(vec4(0.0, 1.0, 0.0, max_bound));
-            C.clip_by_plane(vec4(0.0, -1.0, 0.0, -min_bound));
-            C.clip_by_plane(vec4(0.0, 0.0, 1.0, max_bound));
-            C.clip_by_plane(vec4(0.0, 0.0, -1.0, -min_bound));
-        }
-        C.compute_geometry();
-    }
-    std::vector<double> MCMT::lloyd_relaxation(double *relaxed_point_positions, int num_points, int num_iter)
-    {
-        int current_num_points = point_positions_.size() / 3;
-
-        // Combine existing and new points into all_points
-        std::vector<double> all_points(point_positions_.size() + num_points * 3);
-        std::copy(point_positions_.begin(), point_positions_.end(), all_points.begin());
-        std::copy(relaxed_point_positions, relaxed_point_positions + num_points * 3, all_points.begin() + point_positions_.size());
-
-        // Initialize delaunay_ if necessary
-        if (!delaunay_)
+        if (crosses_period(t))
         {
-            delaunay_ = new PeriodicDelaunay3d(periodic_, 1.0);
-            if (!periodic_)
-                delaunay_->set_keeps_infinite(true);
+            return true;
         }
-
-        // Set vertices and compute Delaunay triangulation
-        delaunay_->set_vertices(all_points.size() / 3, all_points.data());
-        auto start = std::chrono::high_resolution_clock::now();
-        delaunay_->compute();
-        auto end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> diff = end - start;
-        diff = diff * 1000;
-        std::cout << "lloyd relaxation: delaunay compute Time: " << diff.count() << " ms\n";
-
-
-        // Preallocate updated_lloyd_points
-        std::vector<double> updated_lloyd_points(all_points.size());
-
-        double range = max_bound - min_bound;
-
-        for (int iter = 0; iter < num_iter; iter++)
+        for (index_t lv = 0; lv < 4; lv++)
         {
-            // Copy existing points
-            std::copy(all_points.begin(), all_points.begin() + current_num_points * 3, updated_lloyd_points.begin());
-
-            // Parallelize the computation of new points
-            tbb::parallel_for(tbb::blocked_range<index_t>(current_num_points, all_points.size() / 3),
-                [&](const tbb::blocked_range<index_t>& r) {
-                    for (index_t v = r.begin(); v != r.end(); ++v)
-                    {
-                        PeriodicDelaunay3d::IncidentTetrahedra W;
-                        ConvexCell C;
-                        get_cell(v, C, W);
-                        vec3 g = C.barycenter();
-
-                        updated_lloyd_points[3 * v] = g.x;
-                        updated_lloyd_points[3 * v + 1] = g.y;
-                        updated_lloyd_points[3 * v + 2] = g.z;
-
-                        // Adjust for periodicity
-                        for (int d = 0; d < 3; ++d)
-                        {
-                            double& coord = updated_lloyd_points[3 * v + d];
-                            coord = min_bound + std::fmod(coord - min_bound + range, range);
-                        }
-                    }
-                });
-
-            // Swap all_points and updated_lloyd_points
-            std::swap(all_points, updated_lloyd_points);
-
-            // Update delaunay_ with new positions
-            delaunay_->set_vertices(all_points.size() / 3, all_points.data());
-            start = std::chrono::high_resolution_clock::now();
-            delaunay_->compute();
-            end = std::chrono::high_resolution_clock::now();
-            diff = end - start;
-            diff = diff * 1000;
-            std::cout << "lloyd relaxation: delaunay new compute Time: " << diff.count() << " ms\n";
+            int v = delaunay_->cell_vertex(t, lv);
+            if (v == -1 || on_boundary_[v])
+            {
+                return true;
+            }
         }
-
-        // Extract the relaxed points
-        std::vector<double> points_vec(all_points.begin() + current_num_points * 3, all_points.end());
-
-        return points_vec;
+        return false;
     }
 
-    void MCMT::output_grid_points(std::string filename)
+    bool MCMT::crosses_period(index_t t) const
     {
-        std::ofstream outfile(filename);
-        for (int i = 0; i < point_positions_.size() / 3; i++)
+        if (!periodic_)
+        {
+            return false;
+        }
+        for (index_t lv = 0; lv < 4; lv++)
         {
-            outfile << "v " << point_positions_[i * 3] << " " << point_positions_[i * 3 + 1] << " " << point_positions_[i * 3 + 2] << std::endl;
+            if (delaunay_->cell_vertex(t, lv) >= signed_index_t(nb_points()))
+            {
+                return true;
+            }
         }
+        return false;
     }
 
-    void MCMT::save_triangle_mesh(std::string filename)
+    bool MCMT::compute_mid_point(index_t t, double *mid_point) const
     {
+        static const int tet_faces[4][3] = {{0, 1, 2}, {0, 2, 3}, {0, 1, 3}, {1, 2, 3}};
+        const double threshold = 1e-12;
 
-        std::vector<std::vector<double>> mesh_vertices;
-        std::vector<std::vector<int>> mesh_faces;
-
-        std::map<std::pair<int, int>, int> ev_map;
-        int v_counter = 0;
-        std::vector<int> intersection_cell;
-
-        for (int i = 0; i < delaunay_->nb_finite_cells(); i++)
+        const double *p[4];
+        double sd[4];
+        unsigned char index = 0;
+        for (index_t lv = 0; lv < 4; ++lv)
         {
-            std::vector<int> v_indices;
-            bool flag = false;
-            for (index_t lv = 0; lv < 4; ++lv)
+            int v = delaunay_->cell_vertex(t, lv);
+            p[lv] = point_positions_.data() + v * 3;
+            sd[lv] = point_values_[v];
+            if (sd[lv] < 0)
             {
-                int v = delaunay_->cell_vertex(i, lv);
-                v_indices.push_back(int(v));
+                index |= (1 << lv);
             }
+        }
+        if (index == 0x00 || index == 0x0F)
+        {
+            return false;
+        }
 
-            if (point_values_[v_indices[0]] * point_values_[v_indices[1]] < 0)
-            {
-                flag = true;
-                std::pair<int, int> e01 = (v_indices[0] < v_indices[1]) ? std::make_pair(v_indices[0], v_indices[1]) : std::make_pair(v_indices[1], v_indices[0]);
-                if (ev_map.find(e01) == ev_map.end())
-                {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[0] * 3, point_positions_.data() + v_indices[1] * 3, point_values_[v_indices[0]], point_values_[v_indices[1]]);
-                    ev_map.insert({e01, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
-                }
-            }
-            if (point_values_[v_indices[0]] * point_values_[v_indices[2]] < 0)
-            {
-                flag = true;
-                std::pair<int, int> e02 = (v_indices[0] < v_indices[2]) ? std::make_pair(v_indices[0], v_indices[2]) : std::make_pair(v_indices[2], v_indices[0]);
-                if (ev_map.find(e02) == ev_map.end())
-                {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[0] * 3, point_positions_.data() + v_indices[2] * 3, point_values_[v_indices[0]], point_values_[v_indices[2]]);
-                    ev_map.insert({e02, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
-                }
-            }
-            if (point_values_[v_indices[0]] * point_values_[v_indices[3]] < 0)
-            {
-                flag = true;
-                std::pair<int, int> e03 = (v_indices[0] < v_indices[3]) ? std::make_pair(v_indices[0], v_indices[3]) : std::make_pair(v_indices[3], v_indices[0]);
-                if (ev_map.find(e03) == ev_map.end())
-                {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[0] * 3, point_positions_.data() + v_indices[3] * 3, point_values_[v_indices[0]], point_values_[v_indices[3]]);
-                    ev_map.insert({e03, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
-                }
-            }
-            if (point_values_[v_indices[1]] * point_values_[v_indices[2]] < 0)
-            {
-                flag = true;
-                std::pair<int, int> e12 = (v_indices[1] < v_indices[2]) ? std::make_pair(v_indices[1], v_indices[2]) : std::make_pair(v_indices[2], v_indices[1]);
-                if (ev_map.find(e12) == ev_map.end())
-                {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[1] * 3, point_positions_.data() + v_indices[2] * 3, point_values_[v_indices[1]], point_values_[v_indices[2]]);
-                    ev_map.insert({e12, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
-                }
-            }
-            if (point_values_[v_indices[1]] * point_values_[v_indices[3]] < 0)
+        // average of the edge crossings
+        int num_intersections = 0;
+        mid_point[0] = mid_point[1] = mid_point[2] = 0;
+        for (int e = 0; e < 6; e++)
+        {
+            int a = tet_edges[e][0];
+            int b = tet_edges[e][1];
+            if (sd[a] * sd[b] < 0)
             {
-                flag = true;
-                std::pair<int, int> e13 = (v_indices[1] < v_indices[3]) ? std::make_pair(v_indices[1], v_indices[3]) : std::make_pair(v_indices[3], v_indices[1]);
-                if (ev_map.find(e13) == ev_map.end())
-                {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[1] * 3, point_positions_.data() + v_indices[3] * 3, point_values_[v_indices[1]], point_values_[v_indices[3]]);
-                    ev_map.insert({e13, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
-                }
+                double interpolated_point[3];
+                interpolate(p[a], p[b], sd[a], sd[b], interpolated_point);
+                mid_point[0] += interpolated_point[0];
+                mid_point[1] += interpolated_point[1];
+                mid_point[2] += interpolated_point[2];
+                num_intersections++;
             }
-            if (point_values_[v_indices[2]] * point_values_[v_indices[3]] < 0)
+        }
+        if (num_intersections == 0)
+        {
+            return false;
+        }
+        mid_point[0] /= num_intersections;
+        mid_point[1] /= num_intersections;
+        mid_point[2] /= num_intersections;
+
+        // reject mid points lying on a face of t, the four tets spanned by
+        // the faces and the mid point are laid out as in TetBatch
+        double face_tets[12 * 4];
+        for (int f = 0; f < 4; f++)
+        {
+            for (int k = 0; k < 3; k++)
             {
-                flag = true;
-                std::pair<int, int> e23 = (v_indices[2] < v_indices[3]) ? std::make_pair(v_indices[2], v_indices[3]) : std::make_pair(v_indices[3], v_indices[2]);
-                if (ev_map.find(e23) == ev_map.end())
+                for (int c = 0; c < 3; c++)
                 {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[2] * 3, point_positions_.data() + v_indices[3] * 3, point_values_[v_indices[2]], point_values_[v_indices[3]]);
-                    ev_map.insert({e23, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
+                    face_tets[(k * 3 + c) * 4 + f] = p[tet_faces[f][k]][c];
                 }
             }
-
-            if (flag)
+            for (int c = 0; c < 3; c++)
             {
-                intersection_cell.push_back(i);
+                face_tets[(9 + c) * 4 + f] = mid_point[c];
             }
         }
-        for (int i = 0; i < intersection_cell.size(); i++)
+        double volumes[4];
+        tet_volumes(4, face_tets, 4, volumes);
+        for (int f = 0; f < 4; f++)
         {
-            int cell_index = intersection_cell[i];
-
-            unsigned char index = 0;
-            std::vector<int> v_indices;
-            for (index_t lv = 0; lv < 4; ++lv)
+            if (volumes[f] < threshold)
             {
-                int v = delaunay_->cell_vertex(cell_index, lv);
-                v_indices.push_back(int(v));
-
-                if (point_values_[v] < 0)
-                {
-                    index |= (1 << lv);
-                }
+                return false;
             }
+        }
+        return true;
+    }
 
-            std::pair<int, int> e01 = (v_indices[0] < v_indices[1]) ? std::make_pair(v_indices[0], v_indices[1]) : std::make_pair(v_indices[1], v_indices[0]);
-            std::pair<int, int> e02 = (v_indices[0] < v_indices[2]) ? std::make_pair(v_indices[0], v_indices[2]) : std::make_pair(v_indices[2], v_indices[0]);
-            std::pair<int, int> e03 = (v_indices[0] < v_indices[3]) ? std::make_pair(v_indices[0], v_indices[3]) : std::make_pair(v_indices[3], v_indices[0]);
-            std::pair<int, int> e12 = (v_indices[1] < v_indices[2]) ? std::make_pair(v_indices[1], v_indices[2]) : std::make_pair(v_indices[2], v_indices[1]);
-            std::pair<int, int> e13 = (v_indices[1] < v_indices[3]) ? std::make_pair(v_indices[1], v_indices[3]) : std::make_pair(v_indices[3], v_indices[1]);
-            std::pair<int, int> e23 = (v_indices[2] < v_indices[3]) ? std::make_pair(v_indices[2], v_indices[3]) : std::make_pair(v_indices[3], v_indices[2]);
-
-            int v00, v10, v20, v01, v11, v21;
-
-            // Case analysis
-            switch (index)
-            {
-                // skip inside or outside situitions
-            case 0x00:
-            case 0x0F:
-                break;
-                // only vert 0 is inside
-            case 0x01:
-                v00 = ev_map[e01];
-                v10 = ev_map[e03];
-                v20 = ev_map[e02];
-
-                mesh_faces.push_back({v00, v20, v10});
-                break;
-
-                // only vert 1 is inside
-            case 0x02:
-                v00 = ev_map[e01];
-                v10 = ev_map[e12];
-                v20 = ev_map[e13];
-
-                mesh_faces.push_back({v00, v20, v10});
-                break;
-
-                // only vert 2 is inside
-            case 0x04:
-                v00 = ev_map[e02];
-                v10 = ev_map[e23];
-                v20 = ev_map[e12];
-
-                mesh_faces.push_back({v00, v20, v10});
-                break;
-
-                // only vert 3 is inside
-            case 0x08:
-                v00 = ev_map[e13];
-                v10 = ev_map[e23];
-                v20 = ev_map[e03];
+    void MCMT::get_cell(index_t v, ConvexCell &C, PeriodicDelaunay3d::IncidentTetrahedra &W)
+    {
+        get_cell(delaunay_, v, C, W);
+    }
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+    void MCMT::get_cell(const PeriodicDelaunay3d *delaunay, index_t v, ConvexCell &C, PeriodicDelaunay3d::IncidentTetrahedra &W) const
+    {
+        delaunay->copy_Laguerre_cell_from_Delaunay(v, C, W);
+        if (!periodic_)
+        {
+            // keeps the positive side, i.e. domain_min_ <= p <= domain_max_
+            C.clip_by_plane(vec4(1.0, 0.0, 0.0, -domain_min_[0]));
+            C.clip_by_plane(vec4(-1.0, 0.0, 0.0, domain_max_[0]));
+            C.clip_by_plane(vec4(0.0, 1.0, 0.0, -domain_min_[1]));
+            C.clip_by_plane(vec4(0.0, -1.0, 0.0, domain_max_[1]));
+            C.clip_by_plane(vec4(0.0, 0.0, 1.0, -domain_min_[2]));
+            C.clip_by_plane(vec4(0.0, 0.0, -1.0, domain_max_[2]));
+        }
+        C.compute_geometry();
+    }
 
-                // verts 0, 1 are inside
-            case 0x03:
-                v00 = ev_map[e03];
-                v10 = ev_map[e02];
-                v20 = ev_map[e13];
+    bool MCMT::get_lloyd_neighbourhood(const double *relaxed_point_positions, int num_points, std::vector<index_t> &frozen_ids)
+    {
+        // the index follows appends, it is rebuilt only after the points were replaced
+        if (!point_index_ || point_index_->size() > nb_points())
+        {
+            point_index_.reset(new PointIndex(point_positions_));
+        }
+        point_index_->update();
+        track_memory();
+
+        // The cell of p clipped by its k nearest frozen points contains its
+        // true cell. With R the distance from p to the farthest corner of that
+        // cell, a point farther than 2 R from p is farther than R from any
+        // point of the cell, its bisector cannot cut the cell. k doubles until
+        // the k-th neighbour is beyond 2 R
+        tbb::enumerable_thread_specific<std::vector<index_t>> local_ids;
+        TraceRecorder *tracer = trace();
+        const size_t num_frozen = nb_points();
+        tbb::parallel_for(tbb::blocked_range<int>(0, num_points),
+                          [&](tbb::blocked_range<int> ti)
+                          {
+                              TraceScope task(tracer, "neighbourhood_task", ti.size());
+                              std::vector<index_t> &ids = local_ids.local();
+                              std::vector<size_t> indices;
+                              std::vector<double> dists;
+                              ConvexCell C;
+                              for (int i = ti.begin(); i < ti.end(); i++)
+                              {
+                                  const double *p = relaxed_point_positions + i * 3;
+                                  size_t k = std::min(size_t(32), num_frozen);
+                                  size_t num_found = 0;
+                                  while (true)
+                                  {
+                                      indices.resize(k);
+                                      dists.resize(k);
+                                      num_found = point_index_->nearest(p, k, indices.data(), dists.data());
+                                      if (num_found == num_frozen)
+                                          break;
+
+                                      C.init_with_box(domain_min_[0], domain_min_[1], domain_min_[2], domain_max_[0], domain_max_[1], domain_max_[2]);
+                                      for (size_t j = 0; j < num_found; j++)
+                                      {
+                                          const double *q = point_positions_.data() + indices[j] * 3;
+                                          // |x - p|^2 <= |x - q|^2
+                                          C.clip_by_plane(vec4(2.0 * (p[0] - q[0]), 2.0 * (p[1] - q[1]), 2.0 * (p[2] - q[2]),
+                                                               q[0] * q[0] + q[1] * q[1] + q[2] * q[2] - p[0] * p[0] - p[1] * p[1] - p[2] * p[2]));
+                                      }
+                                      C.compute_geometry();
+                                      if (dists[num_found - 1] > 4.0 * C.squared_radius(vec3(p[0], p[1], p[2])))
+                                          break;
+                                      k = std::min(k * 2, num_frozen);
+                                  }
+                                  for (size_t j = 0; j < num_found; j++)
+                                  {
+                                      ids.push_back(index_t(indices[j]));
+                                  }
+                              }
+                          });
 
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e02];
-                v11 = ev_map[e12];
-                v21 = ev_map[e13];
+        size_t old_size = frozen_ids.size();
+        for (auto it = local_ids.begin(); it != local_ids.end(); ++it)
+        {
+            frozen_ids.insert(frozen_ids.end(), it->begin(), it->end());
+        }
+        tbb::parallel_sort(frozen_ids.begin(), frozen_ids.end());
+        frozen_ids.erase(std::unique(frozen_ids.begin(), frozen_ids.end()), frozen_ids.end());
+        return frozen_ids.size() > old_size;
+    }
 
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+    std::vector<double> MCMT::get_lloyd_points(bool local, const std::vector<index_t> &frozen_ids, const double *relaxed_point_positions, int num_points) const
+    {
+        std::vector<double> all_points;
+        if (local)
+        {
+            all_points.resize(frozen_ids.size() * 3);
+            tbb::parallel_for(size_t(0), frozen_ids.size(), [&](size_t i)
+                              { std::copy_n(point_positions_.begin() + frozen_ids[i] * 3, 3, all_points.begin() + i * 3); });
+        }
+        else
+        {
+            all_points = point_positions_;
+        }
+        all_points.insert(all_points.end(), relaxed_point_positions, relaxed_point_positions + num_points * 3);
+        return all_points;
+    }
 
-                // verts 0, 2 are inside
-            case 0x05:
-                v00 = ev_map[e03];
-                v10 = ev_map[e12];
-                v20 = ev_map[e01];
+    std::vector<double> MCMT::lloyd_relaxation(double *relaxed_point_positions, int num_points, int num_iter, LloydMode mode, bool density_weighted, double tolerance)
+    {
+        ScopedTimer timer(stats(), trace(), STAGE_RELAXATION);
+        // Frozen points taking part in the relaxation: the whole grid, or only
+        // the neighbourhood of the relaxed points so that the cost scales with
+        // the batch size
+        bool local = mode == LLOYD_LOCAL && nb_points() > 0 && !periodic_;
+        std::vector<index_t> frozen_ids;
+        if (local)
+        {
+            get_lloyd_neighbourhood(relaxed_point_positions, num_points, frozen_ids);
+        }
+        std::vector<double> all_points = get_lloyd_points(local, frozen_ids, relaxed_point_positions, num_points);
+        int current_num_points = all_points.size() / 3 - num_points;
 
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e12];
-                v11 = ev_map[e03];
-                v21 = ev_map[e23];
+        check_memory_budget(all_points.size() / 3 * bytes_per_new_point + (density_weighted ? size_t(nb_points()) * kdtree_bytes_per_point : 0));
+        // relax on the scratch triangulation so that delaunay_ keeps matching
+        // point_positions_, its allocation is reused across calls
+        if (!lloyd_delaunay_)
+        {
+            lloyd_delaunay_ = create_delaunay();
+        }
+        PeriodicDelaunay3d *delaunay = lloyd_delaunay_;
 
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+        // the density of the weighted mode is the sampling density of
+        // sample_points_rejection, i.e. point_errors_ of the nearest grid point
+        std::unique_ptr<KDTree> density;
+        if (density_weighted && nb_points() > 0)
+        {
+            density.reset(new KDTree(nb_points(), point_positions_.data(), point_errors_.data()));
+            track_memory(density->memory_bytes());
+        }
 
-                // verts 0, 3 are inside
-            case 0x09:
-                v00 = ev_map[e01];
-                v10 = ev_map[e13];
-                v20 = ev_map[e02];
+        // frozen points are the same in both buffers
+        std::vector<double> updated_lloyd_points(all_points);
+        std::vector<double> displacements(num_points);
 
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e13];
-                v11 = ev_map[e23];
-                v21 = ev_map[e02];
+        for (int iter = 0; iter < num_iter; iter++)
+        {
+            // the moved points may reach frozen points outside the neighbourhood
+            if (local && iter > 0 && get_lloyd_neighbourhood(all_points.data() + current_num_points * 3, num_points, frozen_ids))
+            {
+                all_points = get_lloyd_points(true, frozen_ids, all_points.data() + current_num_points * 3, num_points);
+                updated_lloyd_points = all_points;
+                current_num_points = frozen_ids.size();
+            }
 
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+            // Set vertices and compute Delaunay triangulation
+            compute_delaunay(delaunay, all_points.size() / 3, all_points.data());
 
-                // verts 1, 2 are inside
-            case 0x06:
-                v00 = ev_map[e01];
-                v10 = ev_map[e02];
-                v20 = ev_map[e13];
-
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e13];
-                v11 = ev_map[e02];
-                v21 = ev_map[e23];
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+            // Parallelize the computation of new points
+            TraceRecorder *tracer = trace();
+            tbb::parallel_for(tbb::blocked_range<index_t>(current_num_points, all_points.size() / 3),
+                [&](const tbb::blocked_range<index_t>& r) {
+                    TraceScope task(tracer, "lloyd_task", r.size());
+                    PeriodicDelaunay3d::IncidentTetrahedra W;
+                    ConvexCell C;
+                    TetBatch tetrahedrons;
+                    std::vector<double> volumes;
+                    for (index_t v = r.begin(); v != r.end(); ++v)
+                    {
+                        get_cell(delaunay, v, C, W);
+                        vec3 g;
+                        if (density)
+                        {
+                            double mass;
+                            integrate_cell(C, density.get(), tetrahedrons, volumes, mass, g);
+                        }
+                        else
+                        {
+                            g = C.barycenter();
+                        }
 
-                // verts 2, 3 are inside
-            case 0x0C:
-                v00 = ev_map[e13];
-                v10 = ev_map[e02];
-                v20 = ev_map[e03];
-
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e02];
-                v11 = ev_map[e13];
-                v21 = ev_map[e12];
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+                        updated_lloyd_points[3 * v] = g.x;
+                        updated_lloyd_points[3 * v + 1] = g.y;
+                        updated_lloyd_points[3 * v + 2] = g.z;
 
-                // verts 1, 3 are inside
-            case 0x0A:
-                v00 = ev_map[e03];
-                v10 = ev_map[e01];
-                v20 = ev_map[e12];
-
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e12];
-                v11 = ev_map[e23];
-                v21 = ev_map[e03];
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+                        // wrap across the period, or keep inside the box
+                        constrain_point(&updated_lloyd_points[3 * v]);
+                        double displacement = 0;
+                        for (int d = 0; d < 3; ++d)
+                        {
+                            double diff = difference(updated_lloyd_points[3 * v + d], all_points[3 * v + d]);
+                            displacement += diff * diff;
+                        }
+                        displacements[v - current_num_points] = displacement;
+                    }
+                });
 
-                // verts 0, 1, 2 are inside
-            case 0x07:
-                v00 = ev_map[e03];
-                v10 = ev_map[e23];
-                v20 = ev_map[e13];
+            // Swap all_points and updated_lloyd_points
+            std::swap(all_points, updated_lloyd_points);
 
-                mesh_faces.push_back({v00, v20, v10});
+            // stop once no point moves by more than tolerance
+            if (num_points > 0 && *std::max_element(displacements.begin(), displacements.end()) < tolerance * tolerance)
+            {
                 break;
+            }
+        }
 
-                // verts 0, 1, 3 are inside
-            case 0x0B:
-                v00 = ev_map[e12];
-                v10 = ev_map[e23];
-                v20 = ev_map[e02];
+        // Extract the relaxed points
+        std::vector<double> points_vec(all_points.begin() + current_num_points * 3, all_points.end());
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+        return points_vec;
+    }
 
-                // verts 0, 2, 3 are inside
-            case 0x0D:
-                v00 = ev_map[e01];
-                v10 = ev_map[e13];
-                v20 = ev_map[e12];
+    std::vector<double> MCMT::frozen_cell_energies(PeriodicDelaunay3d *delaunay, const std::vector<double> &all_points, index_t first_free,
+                                                   const KDTree *density)
+    {
+        // too few points to triangulate, evaluate_cvt then integrates every cell
+        if (first_free < 4)
+            return std::vector<double>();
+        compute_delaunay(delaunay, first_free, all_points.data());
+        std::vector<double> energies(first_free);
+        TraceRecorder *tracer = trace();
+        tbb::parallel_for(tbb::blocked_range<index_t>(0, first_free),
+                          [&](const tbb::blocked_range<index_t> &r)
+                          {
+                              TraceScope task(tracer, "cvt_task", r.size());
+                              PeriodicDelaunay3d::IncidentTetrahedra W;
+                              ConvexCell C;
+                              TetBatch tetrahedrons;
+                              std::vector<double> volumes;
+                              for (index_t v = r.begin(); v != r.end(); ++v)
+                              {
+                                  get_cell(delaunay, v, C, W);
+                                  double mass;
+                                  vec3 centroid;
+                                  integrate_cell(C, density, tetrahedrons, volumes, mass, centroid, all_points.data() + v * 3, &energies[v]);
+                              }
+                          });
+        return energies;
+    }
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+    double MCMT::evaluate_cvt(PeriodicDelaunay3d *delaunay, const std::vector<double> &all_points, index_t first_free, const KDTree *density,
+                              const std::vector<double> &frozen_energies, std::vector<double> &gradient, std::vector<double> &masses)
+    {
+        index_t num_points = all_points.size() / 3;
+        compute_delaunay(delaunay, num_points, all_points.data());
+
+        // A frozen cell that no free point borders is its cell among the
+        // frozen points alone. The energy is taken relative to those cells,
+        // so only the free cells and their frozen neighbours are integrated,
+        // and 2 m (p - c) stays its exact gradient. Without reference energies
+        // every cell is integrated
+        bool relative = frozen_energies.size() == first_free;
+        std::vector<std::atomic<char>> touched(num_points);
+        tbb::parallel_for(tbb::blocked_range<index_t>(0, num_points),
+                          [&](const tbb::blocked_range<index_t> &r)
+                          {
+                              PeriodicDelaunay3d::IncidentTetrahedra W;
+                              for (index_t v = r.begin(); v != r.end(); ++v)
+                              {
+                                  if (v < first_free)
+                                  {
+                                      if (!relative)
+                                          touched[v].store(1, std::memory_order_relaxed);
+                                      continue;
+                                  }
+                                  touched[v].store(1, std::memory_order_relaxed);
+                                  delaunay->get_incident_tets(v, W);
+                                  for (auto it = W.begin(); it != W.end(); it++)
+                                  {
+                                      for (index_t lv = 0; lv < 4; lv++)
+                                      {
+                                          signed_index_t j = delaunay->cell_vertex(*it, lv);
+                                          if (j == -1)
+                                              continue;
+                                          // periodic copies are numbered after the real vertices
+                                          touched[j % signed_index_t(num_points)].store(1, std::memory_order_relaxed);
+                                      }
+                                  }
+                              }
+                          });
+        std::vector<size_t> cells = MeshCleanup::select(num_points, [&](size_t v)
+                                                        { return touched[v].load(std::memory_order_relaxed) != 0; });
 
-                // verts 1, 2, 3 are inside
-            case 0x0E:
-                v00 = ev_map[e01];
-                v10 = ev_map[e02];
-                v20 = ev_map[e03];
+        std::vector<double> cell_energies(cells.size());
+        TraceRecorder *tracer = trace();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, cells.size()),
+                          [&](const tbb::blocked_range<size_t> &r)
+                          {
+                              TraceScope task(tracer, "cvt_task", r.size());
+                              PeriodicDelaunay3d::IncidentTetrahedra W;
+                              ConvexCell C;
+                              TetBatch tetrahedrons;
+                              std::vector<double> volumes;
+                              for (size_t k = r.begin(); k != r.end(); ++k)
+                              {
+                                  index_t v = index_t(cells[k]);
+                                  get_cell(delaunay, v, C, W);
+                                  double mass;
+                                  vec3 centroid;
+                                  integrate_cell(C, density, tetrahedrons, volumes, mass, centroid, all_points.data() + v * 3, &cell_energies[k]);
+                                  if (v >= first_free)
+                                  {
+                                      index_t i = v - first_free;
+                                      masses[i] = mass;
+                                      gradient[i * 3] = 2.0 * mass * (all_points[v * 3] - centroid.x);
+                                      gradient[i * 3 + 1] = 2.0 * mass * (all_points[v * 3 + 1] - centroid.y);
+                                      gradient[i * 3 + 2] = 2.0 * mass * (all_points[v * 3 + 2] - centroid.z);
+                                  }
+                                  else if (relative)
+                                  {
+                                      cell_energies[k] -= frozen_energies[v];
+                                  }
+                              }
+                          });
+        return std::accumulate(cell_energies.begin(), cell_energies.end(), 0.0);
+    }
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+    std::vector<double> MCMT::lbfgs_relaxation(double *relaxed_point_positions, int num_points, int max_iter, LloydMode mode, bool density_weighted, double tolerance)
+    {
+        ScopedTimer timer(stats(), trace(), STAGE_RELAXATION);
+        const size_t history_size = 7;
+        const int max_line_search = 8;
 
-            default:
-                // assert(false);
-                continue;
-            }
+        bool local = mode == LLOYD_LOCAL && nb_points() > 0 && !periodic_;
+        std::vector<index_t> frozen_ids;
+        if (local)
+        {
+            get_lloyd_neighbourhood(relaxed_point_positions, num_points, frozen_ids);
         }
+        std::vector<double> all_points = get_lloyd_points(local, frozen_ids, relaxed_point_positions, num_points);
+        index_t first_free = all_points.size() / 3 - num_points;
 
-        std::ofstream outfile(filename); // create a file named "example.txt"
-
-        if (outfile.is_open())
+        check_memory_budget(all_points.size() / 3 * bytes_per_new_point + (density_weighted ? size_t(nb_points()) * kdtree_bytes_per_point : 0));
+        if (!lloyd_delaunay_)
         {
-            for (size_t k = 0; k < mesh_vertices.size(); ++k)
-            {
-                std::vector<double> site = mesh_vertices[k];
-                size_t n = site.size();
-                outfile << "v ";
-                for (size_t i = 0; i < site.size(); i++)
-                {
-                    outfile << site[i] << " ";
-                }
-                outfile << " \n";
-            }
-
-            for (size_t j = 0; j < mesh_faces.size(); j++)
-            {
-                std::vector<int> vertices_idx = mesh_faces[j];
-
-                outfile << "f " << vertices_idx[0] + 1 << " " << vertices_idx[1] + 1 << " " << vertices_idx[2] + 1 << " \n";
-            }
+            lloyd_delaunay_ = create_delaunay();
+        }
+        std::unique_ptr<KDTree> density;
+        if (density_weighted && nb_points() > 0)
+        {
+            density.reset(new KDTree(nb_points(), point_positions_.data(), point_errors_.data()));
+            track_memory(density->memory_bytes());
         }
-    }
-
-    std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>> 
-    MCMT::get_triangle_mesh() {
 
-        std::vector<std::vector<double>> mesh_vertices;
-        std::vector<std::vector<int>> mesh_faces;
+        size_t n = size_t(num_points) * 3;
+        std::vector<double> gradient(n), masses(num_points);
+        std::vector<double> frozen_energies = frozen_cell_energies(lloyd_delaunay_, all_points, first_free, density.get());
+        double energy = evaluate_cvt(lloyd_delaunay_, all_points, first_free, density.get(), frozen_energies, gradient, masses);
 
-        std::map<std::pair<int, int>, int> ev_map;
-        int v_counter = 0;
-        std::vector<int> intersection_cell;
+        std::vector<std::vector<double>> s_history, y_history;
+        std::vector<double> rho_history;
+        std::vector<double> direction(n), alpha(history_size);
+        std::vector<double> new_points(all_points), new_gradient(n), new_masses(num_points);
 
-        for (int i = 0; i < delaunay_->nb_finite_cells(); i++)
+        auto dot = [](const std::vector<double> &a, const std::vector<double> &b)
         {
-            std::vector<int> v_indices;
-            bool flag = false;
-            for (index_t lv = 0; lv < 4; ++lv)
+            double result = 0;
+            for (size_t i = 0; i < a.size(); i++)
             {
-                int v = delaunay_->cell_vertex(i, lv);
-                v_indices.push_back(int(v));
+                result += a[i] * b[i];
             }
+            return result;
+        };
 
-            if (point_values_[v_indices[0]] * point_values_[v_indices[1]] < 0)
+        for (int iter = 0; iter < max_iter && num_points > 0; iter++)
+        {
+            // two-loop recursion, the initial inverse Hessian diag(1 / 2m) makes
+            // the first step exactly a Lloyd step
+            direction = gradient;
+            for (int k = int(s_history.size()) - 1; k >= 0; k--)
             {
-                flag = true;
-                std::pair<int, int> e01 = (v_indices[0] < v_indices[1]) ? std::make_pair(v_indices[0], v_indices[1]) : std::make_pair(v_indices[1], v_indices[0]);
-                if (ev_map.find(e01) == ev_map.end())
+                alpha[k] = rho_history[k] * dot(s_history[k], direction);
+                for (size_t i = 0; i < n; i++)
                 {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[0] * 3, point_positions_.data() + v_indices[1] * 3, point_values_[v_indices[0]], point_values_[v_indices[1]]);
-                    ev_map.insert({e01, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
+                    direction[i] -= alpha[k] * y_history[k][i];
                 }
             }
-            if (point_values_[v_indices[0]] * point_values_[v_indices[2]] < 0)
+            for (size_t i = 0; i < n; i++)
             {
-                flag = true;
-                std::pair<int, int> e02 = (v_indices[0] < v_indices[2]) ? std::make_pair(v_indices[0], v_indices[2]) : std::make_pair(v_indices[2], v_indices[0]);
-                if (ev_map.find(e02) == ev_map.end())
-                {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[0] * 3, point_positions_.data() + v_indices[2] * 3, point_values_[v_indices[0]], point_values_[v_indices[2]]);
-                    ev_map.insert({e02, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
-                }
+                direction[i] /= 2.0 * std::max(masses[i / 3], 1e-300);
             }
-            if (point_values_[v_indices[0]] * point_values_[v_indices[3]] < 0)
+            for (size_t k = 0; k < s_history.size(); k++)
             {
-                flag = true;
-                std::pair<int, int> e03 = (v_indices[0] < v_indices[3]) ? std::make_pair(v_indices[0], v_indices[3]) : std::make_pair(v_indices[3], v_indices[0]);
-                if (ev_map.find(e03) == ev_map.end())
+                double beta = rho_history[k] * dot(y_history[k], direction);
+                for (size_t i = 0; i < n; i++)
                 {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[0] * 3, point_positions_.data() + v_indices[3] * 3, point_values_[v_indices[0]], point_values_[v_indices[3]]);
-                    ev_map.insert({e03, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
+                    direction[i] += (alpha[k] - beta) * s_history[k][i];
                 }
             }
-            if (point_values_[v_indices[1]] * point_values_[v_indices[2]] < 0)
+            for (size_t i = 0; i < n; i++)
             {
-                flag = true;
-                std::pair<int, int> e12 = (v_indices[1] < v_indices[2]) ? std::make_pair(v_indices[1], v_indices[2]) : std::make_pair(v_indices[2], v_indices[1]);
-                if (ev_map.find(e12) == ev_map.end())
-                {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[1] * 3, point_positions_.data() + v_indices[2] * 3, point_values_[v_indices[1]], point_values_[v_indices[2]]);
-                    ev_map.insert({e12, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
-                }
+                direction[i] = -direction[i];
             }
-            if (point_values_[v_indices[1]] * point_values_[v_indices[3]] < 0)
+            double slope = dot(gradient, direction);
+            if (slope >= 0)
             {
-                flag = true;
-                std::pair<int, int> e13 = (v_indices[1] < v_indices[3]) ? std::make_pair(v_indices[1], v_indices[3]) : std::make_pair(v_indices[3], v_indices[1]);
-                if (ev_map.find(e13) == ev_map.end())
+                // not a descent direction, restart from a Lloyd step
+                s_history.clear();
+                y_history.clear();
+                rho_history.clear();
+                for (size_t i = 0; i < n; i++)
                 {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[1] * 3, point_positions_.data() + v_indices[3] * 3, point_values_[v_indices[1]], point_values_[v_indices[3]]);
-                    ev_map.insert({e13, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
+                    direction[i] = -gradient[i] / (2.0 * std::max(masses[i / 3], 1e-300));
                 }
+                slope = dot(gradient, direction);
             }
-            if (point_values_[v_indices[2]] * point_values_[v_indices[3]] < 0)
+
+            // backtracking line search with the Armijo condition, points are
+            // kept inside the domain
+            double step = 1.0;
+            double new_energy = energy;
+            bool accepted = false;
+            for (int ls = 0; ls < max_line_search; ls++)
             {
-                flag = true;
-                std::pair<int, int> e23 = (v_indices[2] < v_indices[3]) ? std::make_pair(v_indices[2], v_indices[3]) : std::make_pair(v_indices[3], v_indices[2]);
-                if (ev_map.find(e23) == ev_map.end())
+                for (size_t i = 0; i < n; i++)
                 {
-                    std::vector<double> interpolated_point = interpolate(point_positions_.data() + v_indices[2] * 3, point_positions_.data() + v_indices[3] * 3, point_values_[v_indices[2]], point_values_[v_indices[3]]);
-                    ev_map.insert({e23, mesh_vertices.size()});
-                    mesh_vertices.push_back(interpolated_point);
+                    new_points[first_free * 3 + i] = all_points[first_free * 3 + i] + step * direction[i];
                 }
+                for (int i = 0; i < num_points; i++)
+                {
+                    constrain_point(&new_points[(first_free + i) * 3]);
+                }
+                new_energy = evaluate_cvt(lloyd_delaunay_, new_points, first_free, density.get(), frozen_energies, new_gradient, new_masses);
+                if (new_energy <= energy + 1e-4 * step * slope)
+                {
+                    accepted = true;
+                    break;
+                }
+                step *= 0.5;
             }
-
-            if (flag)
+            if (!accepted)
             {
-                intersection_cell.push_back(i);
+                break;
             }
-        }
-        for (int i = 0; i < intersection_cell.size(); i++)
-        {
-            int cell_index = intersection_cell[i];
-
-            unsigned char index = 0;
-            std::vector<int> v_indices;
-            for (index_t lv = 0; lv < 4; ++lv)
+            // the moved points may reach frozen points outside the neighbourhood
+            if (local && get_lloyd_neighbourhood(new_points.data() + first_free * 3, num_points, frozen_ids))
             {
-                int v = delaunay_->cell_vertex(cell_index, lv);
-                v_indices.push_back(int(v));
+                new_points = get_lloyd_points(true, frozen_ids, new_points.data() + first_free * 3, num_points);
+                all_points = get_lloyd_points(true, frozen_ids, all_points.data() + first_free * 3, num_points);
+                first_free = frozen_ids.size();
+                frozen_energies = frozen_cell_energies(lloyd_delaunay_, all_points, first_free, density.get());
+                new_energy = evaluate_cvt(lloyd_delaunay_, new_points, first_free, density.get(), frozen_energies, new_gradient, new_masses);
+            }
 
-                if (point_values_[v] < 0)
+            // curvature pair
+            std::vector<double> s_k(n), y_k(n);
+            double max_displacement = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                s_k[i] = difference(new_points[first_free * 3 + i], all_points[first_free * 3 + i]);
+                y_k[i] = new_gradient[i] - gradient[i];
+            }
+            for (int i = 0; i < num_points; i++)
+            {
+                max_displacement = std::max(max_displacement, s_k[i * 3] * s_k[i * 3] + s_k[i * 3 + 1] * s_k[i * 3 + 1] + s_k[i * 3 + 2] * s_k[i * 3 + 2]);
+            }
+            double sy = dot(s_k, y_k);
+            if (sy > 1e-300)
+            {
+                if (s_history.size() == history_size)
                 {
-                    index |= (1 << lv);
+                    s_history.erase(s_history.begin());
+                    y_history.erase(y_history.begin());
+                    rho_history.erase(rho_history.begin());
                 }
+                s_history.push_back(s_k);
+                y_history.push_back(y_k);
+                rho_history.push_back(1.0 / sy);
             }
 
-            std::pair<int, int> e01 = (v_indices[0] < v_indices[1]) ? std::make_pair(v_indices[0], v_indices[1]) : std::make_pair(v_indices[1], v_indices[0]);
-            std::pair<int, int> e02 = (v_indices[0] < v_indices[2]) ? std::make_pair(v_indices[0], v_indices[2]) : std::make_pair(v_indices[2], v_indices[0]);
-            std::pair<int, int> e03 = (v_indices[0] < v_indices[3]) ? std::make_pair(v_indices[0], v_indices[3]) : std::make_pair(v_indices[3], v_indices[0]);
-            std::pair<int, int> e12 = (v_indices[1] < v_indices[2]) ? std::make_pair(v_indices[1], v_indices[2]) : std::make_pair(v_indices[2], v_indices[1]);
-            std::pair<int, int> e13 = (v_indices[1] < v_indices[3]) ? std::make_pair(v_indices[1], v_indices[3]) : std::make_pair(v_indices[3], v_indices[1]);
-            std::pair<int, int> e23 = (v_indices[2] < v_indices[3]) ? std::make_pair(v_indices[2], v_indices[3]) : std::make_pair(v_indices[3], v_indices[2]);
-
-            int v00, v10, v20, v01, v11, v21;
+            std::swap(all_points, new_points);
+            std::swap(gradient, new_gradient);
+            std::swap(masses, new_masses);
+            energy = new_energy;
 
-            // Case analysis
-            switch (index)
+            if (max_displacement < tolerance * tolerance)
             {
-                // skip inside or outside situitions
-            case 0x00:
-            case 0x0F:
-                break;
-                // only vert 0 is inside
-            case 0x01:
-                v00 = ev_map[e01];
-                v10 = ev_map[e03];
-                v20 = ev_map[e02];
-
-                mesh_faces.push_back({v00, v20, v10});
-                break;
-
-                // only vert 1 is inside
-            case 0x02:
-                v00 = ev_map[e01];
-                v10 = ev_map[e12];
-                v20 = ev_map[e13];
-
-                mesh_faces.push_back({v00, v20, v10});
-                break;
-
-                // only vert 2 is inside
-            case 0x04:
-                v00 = ev_map[e02];
-                v10 = ev_map[e23];
-                v20 = ev_map[e12];
-
-                mesh_faces.push_back({v00, v20, v10});
-                break;
-
-                // only vert 3 is inside
-            case 0x08:
-                v00 = ev_map[e13];
-                v10 = ev_map[e23];
-                v20 = ev_map[e03];
-
-                mesh_faces.push_back({v00, v20, v10});
                 break;
+            }
+        }
 
-                // verts 0, 1 are inside
-            case 0x03:
-                v00 = ev_map[e03];
-                v10 = ev_map[e02];
-                v20 = ev_map[e13];
+        return std::vector<double>(all_points.begin() + first_free * 3, all_points.end());
+    }
 
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e02];
-                v11 = ev_map[e12];
-                v21 = ev_map[e13];
+    void MCMT::output_grid_points(std::string filename)
+    {
+        if (!write_mesh(filename, point_positions_, std::vector<int>()))
+        {
+            throw std::runtime_error("MCMT::output_grid_points: cannot write " + filename);
+        }
+    }
 
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+    void MCMT::extract_triangle_mesh(std::vector<double> &mesh_vertices, std::vector<int> &mesh_faces, std::vector<double> *normals,
+                                     const GradientFunction &gradient)
+    {
+        ScopedTimer timer(stats(), trace(), STAGE_EXTRACTION);
 
-                // verts 0, 2 are inside
-            case 0x05:
-                v00 = ev_map[e03];
-                v10 = ev_map[e12];
-                v20 = ev_map[e01];
+        mesh_vertices.clear();
+        mesh_faces.clear();
 
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e12];
-                v11 = ev_map[e03];
-                v21 = ev_map[e23];
+        if (extraction_mode_ == EXTRACTION_DUAL)
+        {
+            extract_dual_mesh(mesh_vertices, mesh_faces, normals, gradient);
+            if (mesh_cleanup_)
+            {
+                MeshCleanup::cleanup(mesh_vertices, mesh_faces, mesh_cleanup_options_, normals);
+            }
+            track_memory(0, mesh_bytes(mesh_vertices, mesh_faces, normals));
+            return;
+        }
 
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+        // sign case of every tet, bit lv set when vertex lv is inside
+        check_memory_budget(delaunay_->nb_finite_cells());
+        std::vector<unsigned char> cases(delaunay_->nb_finite_cells());
+        tbb::parallel_for(index_t(0), delaunay_->nb_finite_cells(), [&](index_t t)
+                          {
+                              unsigned char index = 0;
+                              if (!crosses_period(t))
+                              {
+                                  for (index_t lv = 0; lv < 4; lv++)
+                                  {
+                                      if (point_values_[delaunay_->cell_vertex(t, lv)] < 0)
+                                          index |= (1 << lv);
+                                  }
+                              }
+                              cases[t] = index;
+                          });
+        std::vector<size_t> tets = MeshCleanup::select(cases.size(), [&](size_t t)
+                                                       { return cases[t] != 0x00 && cases[t] != 0x0F; });
+        check_memory_budget(tets.size() * bytes_per_crossed_tet);
 
-                // verts 0, 3 are inside
-            case 0x09:
-                v00 = ev_map[e01];
-                v10 = ev_map[e13];
-                v20 = ev_map[e02];
+        // one vertex per crossed edge: the edges of the crossed tets are
+        // gathered per tet, then sorted and deduplicated in parallel
+        auto crossed = [&](index_t t, int e)
+        {
+            return ((cases[t] >> tet_edges[e][0]) & 1) != ((cases[t] >> tet_edges[e][1]) & 1);
+        };
+        auto tet_edge = [&](index_t t, int e)
+        {
+            int a = delaunay_->cell_vertex(t, tet_edges[e][0]);
+            int b = delaunay_->cell_vertex(t, tet_edges[e][1]);
+            return std::make_pair(std::min(a, b), std::max(a, b));
+        };
+        std::vector<size_t> offsets(tets.size() + 1, 0);
+        tbb::parallel_for(size_t(0), tets.size(), [&](size_t k)
+                          {
+                              size_t num_crossed = 0;
+                              for (int e = 0; e < 6; e++)
+                              {
+                                  num_crossed += crossed(index_t(tets[k]), e);
+                              }
+                              offsets[k + 1] = num_crossed;
+                          });
+        for (size_t k = 0; k < tets.size(); k++)
+        {
+            offsets[k + 1] += offsets[k];
+        }
+        std::vector<std::pair<int, int>> edges(offsets.back());
+        tbb::parallel_for(size_t(0), tets.size(), [&](size_t k)
+                          {
+                              size_t j = offsets[k];
+                              for (int e = 0; e < 6; e++)
+                              {
+                                  if (crossed(index_t(tets[k]), e))
+                                      edges[j++] = tet_edge(index_t(tets[k]), e);
+                              }
+                          });
+        tbb::parallel_sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
 
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e13];
-                v11 = ev_map[e23];
-                v21 = ev_map[e02];
+        mesh_vertices.resize(edges.size() * 3);
+        tbb::parallel_for(size_t(0), edges.size(), [&](size_t e)
+                          {
+                              int a = edges[e].first, b = edges[e].second;
+                              interpolate(point_positions_.data() + a * 3, point_positions_.data() + b * 3, point_values_[a], point_values_[b], mesh_vertices.data() + e * 3);
+                          });
 
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+        // triangles of every tet from its sign case, written at per tet offsets
+        for (size_t k = 0; k < tets.size(); k++)
+        {
+            offsets[k + 1] = offsets[k] + marching_tet_triangles[cases[tets[k]]][6];
+        }
+        mesh_faces.resize(offsets.back() * 3);
+        tbb::parallel_for(size_t(0), tets.size(), [&](size_t k)
+                          {
+                              index_t t = index_t(tets[k]);
+                              const int *triangles = marching_tet_triangles[cases[t]];
+                              for (int i = 0; i < triangles[6] * 3; i++)
+                              {
+                                  mesh_faces[offsets[k] * 3 + i] = int(std::lower_bound(edges.begin(), edges.end(), tet_edge(t, triangles[i])) - edges.begin());
+                              }
+                          });
 
-                // verts 1, 2 are inside
-            case 0x06:
-                v00 = ev_map[e01];
-                v10 = ev_map[e02];
-                v20 = ev_map[e13];
-
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e13];
-                v11 = ev_map[e02];
-                v21 = ev_map[e23];
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+        bool refine = refinement_sdf_ && refinement_steps_ > 0;
+        if (normals || refine)
+        {
+            if (refine)
+            {
+                refine_vertices(edges, mesh_vertices);
+            }
+            if (normals)
+            {
+                compute_normals(edges, mesh_vertices, *normals, gradient);
+            }
+        }
+        if (mesh_cleanup_)
+        {
+            MeshCleanup::cleanup(mesh_vertices, mesh_faces, mesh_cleanup_options_, normals);
+        }
+        track_memory(0, mesh_bytes(mesh_vertices, mesh_faces, normals));
+    }
 
-                // verts 2, 3 are inside
-            case 0x0C:
-                v00 = ev_map[e13];
-                v10 = ev_map[e02];
-                v20 = ev_map[e03];
-
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e02];
-                v11 = ev_map[e13];
-                v21 = ev_map[e12];
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+    bool MCMT::crosses_surface(index_t t) const
+    {
+        if (crosses_period(t))
+            return false;
+        for (int e = 0; e < 6; e++)
+        {
+            if (point_values_[delaunay_->cell_vertex(t, tet_edges[e][0])] * point_values_[delaunay_->cell_vertex(t, tet_edges[e][1])] < 0)
+                return true;
+        }
+        return false;
+    }
 
-                // verts 1, 3 are inside
-            case 0x0A:
-                v00 = ev_map[e03];
-                v10 = ev_map[e01];
-                v20 = ev_map[e12];
-
-                mesh_faces.push_back({v00, v20, v10});
-                v01 = ev_map[e12];
-                v11 = ev_map[e23];
-                v21 = ev_map[e03];
-                mesh_faces.push_back({v01, v21, v11});
-                break;
+    void MCMT::extract_dual_mesh(std::vector<double> &mesh_vertices, std::vector<int> &mesh_faces, std::vector<double> *normals,
+                                 const GradientFunction &gradient)
+    {
+        // crossed tets, the k-th one gets vertex k
+        std::vector<size_t> tets = MeshCleanup::select(delaunay_->nb_finite_cells(), [&](size_t t)
+                                                       { return crosses_surface(index_t(t)); });
+        check_memory_budget(tets.size() * bytes_per_crossed_tet);
+
+        // (crossed edge, tet) pairs, sorted so that the tets around an edge
+        // are contiguous
+        struct EdgeTet
+        {
+            int a, b, vertex;
+            bool operator<(const EdgeTet &other) const
+            {
+                return a < other.a || (a == other.a && (b < other.b || (b == other.b && vertex < other.vertex)));
+            }
+        };
+        std::vector<size_t> offsets(tets.size() + 1, 0);
+        tbb::parallel_for(size_t(0), tets.size(), [&](size_t k)
+                          {
+                              size_t crossed = 0;
+                              for (int e = 0; e < 6; e++)
+                              {
+                                  crossed += point_values_[delaunay_->cell_vertex(index_t(tets[k]), tet_edges[e][0])] *
+                                                 point_values_[delaunay_->cell_vertex(index_t(tets[k]), tet_edges[e][1])] <
+                                             0;
+                              }
+                              offsets[k + 1] = crossed;
+                          });
+        for (size_t k = 0; k < tets.size(); k++)
+        {
+            offsets[k + 1] += offsets[k];
+        }
+        std::vector<EdgeTet> edge_tets(offsets.back());
+        tbb::parallel_for(size_t(0), tets.size(), [&](size_t k)
+                          {
+                              size_t j = offsets[k];
+                              for (int e = 0; e < 6; e++)
+                              {
+                                  int a = delaunay_->cell_vertex(index_t(tets[k]), tet_edges[e][0]);
+                                  int b = delaunay_->cell_vertex(index_t(tets[k]), tet_edges[e][1]);
+                                  if (point_values_[a] * point_values_[b] < 0)
+                                      edge_tets[j++] = {std::min(a, b), std::max(a, b), int(k)};
+                              }
+                          });
+        tbb::parallel_sort(edge_tets.begin(), edge_tets.end());
+        std::vector<size_t> groups = MeshCleanup::select(edge_tets.size(), [&](size_t i)
+                                                         { return i == 0 || edge_tets[i].a != edge_tets[i - 1].a || edge_tets[i].b != edge_tets[i - 1].b; });
+        size_t ne = groups.size();
+        groups.push_back(edge_tets.size());
+
+        // crossings and normals of the edges, the planes of the QEFs
+        std::vector<std::pair<int, int>> edges(ne);
+        std::vector<double> crossings(ne * 3);
+        tbb::parallel_for(size_t(0), ne, [&](size_t e)
+                          {
+                              int a = edge_tets[groups[e]].a, b = edge_tets[groups[e]].b;
+                              edges[e] = std::make_pair(a, b);
+                              interpolate(point_positions_.data() + a * 3, point_positions_.data() + b * 3, point_values_[a], point_values_[b], crossings.data() + e * 3);
+                          });
+        if (refinement_sdf_ && refinement_steps_ > 0)
+        {
+            refine_vertices(edges, crossings);
+        }
+        std::vector<double> edge_normals;
+        compute_normals(edges, crossings, edge_normals, gradient);
 
-                // verts 0, 1, 2 are inside
-            case 0x07:
-                v00 = ev_map[e03];
-                v10 = ev_map[e23];
-                v20 = ev_map[e13];
+        // QEF minimizer of every crossed tet, pulled towards the mean of the
+        // crossings and clamped to the bounding box of the tet
+        mesh_vertices.resize(tets.size() * 3);
+        if (normals)
+        {
+            normals->assign(tets.size() * 3, 0.0);
+        }
+        tbb::parallel_for(size_t(0), tets.size(), [&](size_t k)
+                          {
+                              index_t t = index_t(tets[k]);
+                              int crossed[6], num_crossed = 0;
+                              double mean[3] = {0.0, 0.0, 0.0};
+                              for (int e = 0; e < 6; e++)
+                              {
+                                  int a = delaunay_->cell_vertex(t, tet_edges[e][0]);
+                                  int b = delaunay_->cell_vertex(t, tet_edges[e][1]);
+                                  if (point_values_[a] * point_values_[b] >= 0)
+                                      continue;
+                                  int edge = int(std::lower_bound(edges.begin(), edges.end(), std::make_pair(std::min(a, b), std::max(a, b))) - edges.begin());
+                                  crossed[num_crossed++] = edge;
+                                  for (int c = 0; c < 3; c++)
+                                  {
+                                      mean[c] += crossings[edge * 3 + c];
+                                  }
+                              }
+                              for (int c = 0; c < 3; c++)
+                              {
+                                  mean[c] /= num_crossed;
+                              }
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+                              // minimizes sum (n . (x - p))^2 + qef_regularization |x - mean|^2
+                              double A[3][3] = {}, r[3] = {}, offset[3] = {0.0, 0.0, 0.0};
+                              double normal[3] = {0.0, 0.0, 0.0};
+                              for (int i = 0; i < num_crossed; i++)
+                              {
+                                  const double *n = edge_normals.data() + crossed[i] * 3;
+                                  const double *p = crossings.data() + crossed[i] * 3;
+                                  double distance = n[0] * (p[0] - mean[0]) + n[1] * (p[1] - mean[1]) + n[2] * (p[2] - mean[2]);
+                                  for (int row = 0; row < 3; row++)
+                                  {
+                                      for (int c = 0; c < 3; c++)
+                                      {
+                                          A[row][c] += n[row] * n[c];
+                                      }
+                                      r[row] += n[row] * distance;
+                                      normal[row] += n[row];
+                                  }
+                              }
+                              for (int c = 0; c < 3; c++)
+                              {
+                                  A[c][c] += qef_regularization;
+                              }
+                              solve_3x3(A, r, offset);
 
-                // verts 0, 1, 3 are inside
-            case 0x0B:
-                v00 = ev_map[e12];
-                v10 = ev_map[e23];
-                v20 = ev_map[e02];
+                              for (int c = 0; c < 3; c++)
+                              {
+                                  double lo = std::numeric_limits<double>::max(), hi = -std::numeric_limits<double>::max();
+                                  for (index_t lv = 0; lv < 4; lv++)
+                                  {
+                                      double x = point_positions_[delaunay_->cell_vertex(t, lv) * 3 + c];
+                                      lo = std::min(lo, x);
+                                      hi = std::max(hi, x);
+                                  }
+                                  mesh_vertices[k * 3 + c] = std::min(std::max(mean[c] + offset[c], lo), hi);
+                              }
+                              if (normals)
+                              {
+                                  double length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+                                  for (int c = 0; c < 3; c++)
+                                  {
+                                      (*normals)[k * 3 + c] = length > 0.0 ? normal[c] / length : 0.0;
+                                  }
+                              }
+                          });
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+        // polygon of the tets around every crossed edge, ordered by angle
+        // around the edge and fanned into triangles facing the positive end
+        std::vector<size_t> face_offsets(ne + 1, 0);
+        for (size_t e = 0; e < ne; e++)
+        {
+            size_t ring = groups[e + 1] - groups[e];
+            face_offsets[e + 1] = face_offsets[e] + (ring >= 3 ? ring - 2 : 0);
+        }
+        mesh_faces.resize(face_offsets.back() * 3);
+        tbb::parallel_for(size_t(0), ne, [&](size_t e)
+                          {
+                              size_t ring = groups[e + 1] - groups[e];
+                              if (ring < 3)
+                                  return;
+                              int negative = edges[e].first, positive = edges[e].second;
+                              if (point_values_[negative] > 0)
+                                  std::swap(negative, positive);
+                              const double *origin = point_positions_.data() + negative * 3;
+                              double axis[3], u[3], v[3];
+                              for (int c = 0; c < 3; c++)
+                              {
+                                  axis[c] = point_positions_[positive * 3 + c] - origin[c];
+                              }
+                              // u, v, axis right handed
+                              int smallest = std::abs(axis[0]) < std::abs(axis[1]) ? (std::abs(axis[0]) < std::abs(axis[2]) ? 0 : 2) : (std::abs(axis[1]) < std::abs(axis[2]) ? 1 : 2);
+                              double helper[3] = {0.0, 0.0, 0.0};
+                              helper[smallest] = 1.0;
+                              u[0] = helper[1] * axis[2] - helper[2] * axis[1];
+                              u[1] = helper[2] * axis[0] - helper[0] * axis[2];
+                              u[2] = helper[0] * axis[1] - helper[1] * axis[0];
+                              v[0] = axis[1] * u[2] - axis[2] * u[1];
+                              v[1] = axis[2] * u[0] - axis[0] * u[2];
+                              v[2] = axis[0] * u[1] - axis[1] * u[0];
+
+                              // the centroid of a tet lies in its wedge around the edge
+                              std::vector<std::pair<double, int>> angles(ring);
+                              for (size_t i = 0; i < ring; i++)
+                              {
+                                  int k = edge_tets[groups[e] + i].vertex;
+                                  double d[3] = {0.0, 0.0, 0.0};
+                                  for (index_t lv = 0; lv < 4; lv++)
+                                  {
+                                      for (int c = 0; c < 3; c++)
+                                      {
+                                          d[c] += 0.25 * point_positions_[delaunay_->cell_vertex(index_t(tets[k]), lv) * 3 + c];
+                                      }
+                                  }
+                                  for (int c = 0; c < 3; c++)
+                                  {
+                                      d[c] -= origin[c];
+                                  }
+                                  angles[i] = std::make_pair(std::atan2(d[0] * v[0] + d[1] * v[1] + d[2] * v[2], d[0] * u[0] + d[1] * u[1] + d[2] * u[2]), k);
+                              }
+                              std::sort(angles.begin(), angles.end());
 
-                // verts 0, 2, 3 are inside
-            case 0x0D:
-                v00 = ev_map[e01];
-                v10 = ev_map[e13];
-                v20 = ev_map[e12];
+                              // an open ring (edge on the hull or across the period)
+                              // starts after its largest angular gap
+                              size_t start = 0;
+                              double largest_gap = angles[0].first + two_pi - angles[ring - 1].first;
+                              for (size_t i = 1; i < ring; i++)
+                              {
+                                  if (angles[i].first - angles[i - 1].first > largest_gap)
+                                  {
+                                      largest_gap = angles[i].first - angles[i - 1].first;
+                                      start = i;
+                                  }
+                              }
+                              std::rotate(angles.begin(), angles.begin() + start, angles.end());
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+                              int *face = mesh_faces.data() + face_offsets[e] * 3;
+                              for (size_t i = 1; i + 1 < ring; i++)
+                              {
+                                  *face++ = angles[0].second;
+                                  *face++ = angles[i].second;
+                                  *face++ = angles[i + 1].second;
+                              }
+                          });
+    }
 
-                // verts 1, 2, 3 are inside
-            case 0x0E:
-                v00 = ev_map[e01];
-                v10 = ev_map[e02];
-                v20 = ev_map[e03];
+    void MCMT::refine_vertices(const std::vector<std::pair<int, int>> &vertex_edges, std::vector<double> &mesh_vertices)
+    {
+        ScopedTimer timer(stats(), trace(), STAGE_REFINEMENT);
+        // bracket [lo, hi] of the zero crossing along each edge, in edge
+        // parameters, and the current estimate t
+        struct Bracket
+        {
+            double t_lo, f_lo, t_hi, f_hi, t;
+            // side kept by the last step, for the Illinois variant of the secant
+            int kept;
+        };
+        size_t nv = vertex_edges.size();
+        std::vector<Bracket> brackets(nv);
+        tbb::parallel_for(size_t(0), nv, [&](size_t i)
+                          {
+                              int a = vertex_edges[i].first, b = vertex_edges[i].second;
+                              double ab2 = 0.0, ap_ab = 0.0;
+                              for (int c = 0; c < 3; c++)
+                              {
+                                  double ab = point_positions_[b * 3 + c] - point_positions_[a * 3 + c];
+                                  ab2 += ab * ab;
+                                  ap_ab += (mesh_vertices[i * 3 + c] - point_positions_[a * 3 + c]) * ab;
+                              }
+                              double t = ab2 > 0.0 ? std::min(std::max(ap_ab / ab2, 0.0), 1.0) : 0.5;
+                              brackets[i] = {0.0, point_values_[a], 1.0, point_values_[b], t, 0};
+                          });
 
-                mesh_faces.push_back({v00, v20, v10});
-                break;
+        std::vector<size_t> active(nv);
+        for (size_t i = 0; i < nv; i++)
+        {
+            active[i] = i;
+        }
+        std::vector<double> points, values;
+        for (int step = 0; step < refinement_steps_ && !active.empty(); step++)
+        {
+            points.resize(active.size() * 3);
+            values.resize(active.size());
+            tbb::parallel_for(size_t(0), active.size(), [&](size_t k)
+                              { std::copy_n(mesh_vertices.begin() + active[k] * 3, 3, points.begin() + k * 3); });
+            refinement_sdf_(active.size(), points.data(), values.data());
+            count(COUNTER_SDF_VALUES, active.size());
+
+            tbb::parallel_for(size_t(0), active.size(), [&](size_t k)
+                              {
+                                  size_t i = active[k];
+                                  Bracket &br = brackets[i];
+                                  double f = values[k];
+                                  if (std::abs(f) <= refinement_tolerance_)
+                                  {
+                                      br.kept = 2;
+                                      return;
+                                  }
+                                  // halving the value of an end kept twice keeps the secant
+                                  // from stalling on one side
+                                  if ((f < 0) == (br.f_lo < 0))
+                                  {
+                                      br.t_lo = br.t;
+                                      br.f_lo = f;
+                                      if (br.kept == -1)
+                                          br.f_hi *= 0.5;
+                                      br.kept = -1;
+                                  }
+                                  else
+                                  {
+                                      br.t_hi = br.t;
+                                      br.f_hi = f;
+                                      if (br.kept == 1)
+                                          br.f_lo *= 0.5;
+                                      br.kept = 1;
+                                  }
+                                  double t = br.t_lo + (br.t_hi - br.t_lo) * br.f_lo / (br.f_lo - br.f_hi);
+                                  br.t = t > br.t_lo && t < br.t_hi ? t : 0.5 * (br.t_lo + br.t_hi);
 
-            default:
-                // assert(false);
-                continue;
-            }
+                                  const double *a = point_positions_.data() + vertex_edges[i].first * 3;
+                                  const double *b = point_positions_.data() + vertex_edges[i].second * 3;
+                                  for (int c = 0; c < 3; c++)
+                                  {
+                                      mesh_vertices[i * 3 + c] = a[c] + br.t * (b[c] - a[c]);
+                                  }
+                              });
+            // converged vertices are not queried again
+            active.erase(std::remove_if(active.begin(), active.end(), [&](size_t i)
+                                        { return brackets[i].kept == 2; }),
+                         active.end());
         }
-        return std::make_pair(mesh_vertices, mesh_faces);
     }
 
-    void MCMT::save_grid_mesh(std::string filename, float x_clip_plane)
+    void MCMT::estimate_gradient(index_t v, double *gradient) const
     {
-
-        std::vector<std::vector<double>> mesh_vertices;
-        std::vector<std::vector<int>> mesh_faces;
-
-        for (int i = 0; i < delaunay_->nb_vertices(); i++)
+        std::vector<index_t> neighbors;
+        PeriodicDelaunay3d::IncidentTetrahedra W;
+        delaunay_->get_incident_tets(v, W);
+        for (auto it = W.begin(); it != W.end(); it++)
         {
-            double x = delaunay_->vertex_ptr(i)[0];
-            double y = delaunay_->vertex_ptr(i)[1];
-            double z = delaunay_->vertex_ptr(i)[2];
-            mesh_vertices.push_back(std::vector<double>{x, y, z});
+            for (index_t lv = 0; lv < 4; lv++)
+            {
+                signed_index_t j = delaunay_->cell_vertex(*it, lv);
+                if (j == -1)
+                    continue;
+                // periodic copies are numbered after the real vertices
+                j = j % signed_index_t(nb_points());
+                if (index_t(j) != v)
+                    neighbors.push_back(index_t(j));
+            }
         }
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
 
-        for (int i = 0; i < delaunay_->nb_finite_cells(); i++)
+        // fit of f(x_j) - f(x_v) = g . (x_j - x_v), weighted by 1 / |x_j - x_v|^2
+        double A[3][3] = {}, b[3] = {};
+        for (index_t j : neighbors)
         {
-            std::vector<int> v_indices;
-            bool flag = false;
-            for (index_t lv = 0; lv < 4; ++lv)
+            double d[3];
+            for (int c = 0; c < 3; c++)
             {
-                int v = delaunay_->cell_vertex(i, lv);
-                double x = delaunay_->vertex_ptr(v)[0];
-
-                if (x < x_clip_plane)
+                d[c] = difference(point_positions_[j * 3 + c], point_positions_[v * 3 + c]);
+            }
+            double length2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+            if (length2 == 0.0)
+                continue;
+            double df = (point_values_[j] - point_values_[v]) / length2;
+            for (int r = 0; r < 3; r++)
+            {
+                for (int c = 0; c < 3; c++)
                 {
-                    flag = true;
-                    break;
+                    A[r][c] += d[r] * d[c] / length2;
                 }
-                v_indices.push_back(int(v));
+                b[r] += df * d[r];
             }
-            if (flag)
-                continue;
-            mesh_faces.push_back(v_indices);
         }
 
-        std::ofstream outfile(filename); // create a file named "example.txt"
+        if (!solve_3x3(A, b, gradient))
+        {
+            gradient[0] = gradient[1] = gradient[2] = 0.0;
+        }
+    }
 
-        if (outfile.is_open())
+    void MCMT::compute_normals(const std::vector<std::pair<int, int>> &vertex_edges, const std::vector<double> &mesh_vertices,
+                               std::vector<double> &normals, const GradientFunction &gradient) const
+    {
+        size_t nv = vertex_edges.size();
+        normals.assign(nv * 3, 0.0);
+        if (gradient)
+        {
+            gradient(nv, mesh_vertices.data(), normals.data());
+        }
+        else
         {
-            for (size_t k = 0; k < mesh_vertices.size(); ++k)
+            // gradients at the ends of the crossed edges, interpolated along them
+            std::vector<int> slot(nb_points(), -1);
+            std::vector<index_t> ends;
+            for (const std::pair<int, int> &edge : vertex_edges)
             {
-                std::vector<double> site = mesh_vertices[k];
-                size_t n = site.size();
-                outfile << "v ";
-                for (size_t i = 0; i < site.size(); i++)
+                for (int v : {edge.first, edge.second})
                 {
-                    outfile << site[i] << " ";
+                    if (slot[v] < 0)
+                    {
+                        slot[v] = int(ends.size());
+                        ends.push_back(index_t(v));
+                    }
                 }
-                outfile << " \n";
             }
+            std::vector<double> gradients(ends.size() * 3);
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, ends.size()), [&](tbb::blocked_range<size_t> r)
+                              {
+                                  for (size_t k = r.begin(); k < r.end(); k++)
+                                  {
+                                      estimate_gradient(ends[k], gradients.data() + k * 3);
+                                  }
+                              });
+            tbb::parallel_for(size_t(0), nv, [&](size_t i)
+                              {
+                                  const double *a = point_positions_.data() + vertex_edges[i].first * 3;
+                                  const double *b = point_positions_.data() + vertex_edges[i].second * 3;
+                                  const double *p = mesh_vertices.data() + i * 3;
+                                  double ab2 = 0.0, ap_ab = 0.0;
+                                  for (int c = 0; c < 3; c++)
+                                  {
+                                      ab2 += (b[c] - a[c]) * (b[c] - a[c]);
+                                      ap_ab += (p[c] - a[c]) * (b[c] - a[c]);
+                                  }
+                                  double t = ab2 > 0.0 ? std::min(std::max(ap_ab / ab2, 0.0), 1.0) : 0.5;
+                                  const double *ga = gradients.data() + slot[vertex_edges[i].first] * 3;
+                                  const double *gb = gradients.data() + slot[vertex_edges[i].second] * 3;
+                                  for (int c = 0; c < 3; c++)
+                                  {
+                                      normals[i * 3 + c] = (1.0 - t) * ga[c] + t * gb[c];
+                                  }
+                              });
+        }
+        tbb::parallel_for(size_t(0), nv, [&](size_t i)
+                          {
+                              double *n = normals.data() + i * 3;
+                              double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                              if (length > 0.0)
+                              {
+                                  n[0] /= length;
+                                  n[1] /= length;
+                                  n[2] /= length;
+                              }
+                          });
+    }
 
-            for (size_t j = 0; j < mesh_faces.size(); j++)
-            {
-                std::vector<int> vertices_idx = mesh_faces[j];
 
-                if (vertices_idx.size() == 4)
-                {
-                    outfile << "f " << vertices_idx[0] + 1 << " " << vertices_idx[2] + 1 << " " << vertices_idx[1] + 1 << " \n";
-                    outfile << "f " << vertices_idx[0] + 1 << " " << vertices_idx[3] + 1 << " " << vertices_idx[2] + 1 << " \n";
-                    outfile << "f " << vertices_idx[0] + 1 << " " << vertices_idx[1] + 1 << " " << vertices_idx[3] + 1 << " \n";
-                    outfile << "f " << vertices_idx[1] + 1 << " " << vertices_idx[2] + 1 << " " << vertices_idx[3] + 1 << " \n";
-                }
-            }
+    void MCMT::save_triangle_mesh(std::string filename)
+    {
+        std::vector<double> mesh_vertices;
+        std::vector<int> mesh_faces;
+        extract_triangle_mesh(mesh_vertices, mesh_faces);
+        if (!write_mesh(filename, mesh_vertices, mesh_faces))
+        {
+            throw std::runtime_error("MCMT::save_triangle_mesh: cannot write " + filename);
         }
     }
 
-    std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>> 
-    MCMT::get_grid_mesh(float x_clip_plane)
+    void MCMT::get_triangle_mesh(std::vector<double> &vertices, std::vector<int> &faces, std::vector<double> &normals,
+                                 const GradientFunction &gradient)
     {
+        extract_triangle_mesh(vertices, faces, &normals, gradient);
+    }
 
-        std::vector<std::vector<double>> mesh_vertices;
-        std::vector<std::vector<int>> mesh_faces;
-
-        for (int i = 0; i < delaunay_->nb_vertices(); i++)
+    std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>>
+    MCMT::get_triangle_mesh()
+    {
+        std::vector<double> vertices;
+        std::vector<int> faces;
+        extract_triangle_mesh(vertices, faces);
+
+        size_t nested_bytes = (vertices.size() / 3 + faces.size() / 3) * nested_vector_bytes + mesh_bytes(vertices, faces, nullptr);
+        check_memory_budget(mesh_bytes(vertices, faces, nullptr) + nested_bytes);
+        track_memory(0, mesh_bytes(vertices, faces, nullptr) + nested_bytes);
+        std::vector<std::vector<double>> mesh_vertices(vertices.size() / 3);
+        for (size_t i = 0; i < mesh_vertices.size(); i++)
+        {
+            mesh_vertices[i].assign(vertices.begin() + i * 3, vertices.begin() + i * 3 + 3);
+        }
+        std::vector<std::vector<int>> mesh_faces(faces.size() / 3);
+        for (size_t i = 0; i < mesh_faces.size(); i++)
         {
-            double x = delaunay_->vertex_ptr(i)[0];
-            double y = delaunay_->vertex_ptr(i)[1];
-            double z = delaunay_->vertex_ptr(i)[2];
-            mesh_vertices.push_back(std::vector<double>{x, y, z});
+            mesh_faces[i].assign(faces.begin() + i * 3, faces.begin() + i * 3 + 3);
         }
+        return std::make_pair(mesh_vertices, mesh_faces);
+    }
+
+    void MCMT::save_grid_mesh(std::string filename, float x_clip_plane)
+    {
+        save_grid_mesh(filename, GridClip::x_plane(x_clip_plane));
+    }
 
-        for (int i = 0; i < delaunay_->nb_finite_cells(); i++)
+    void MCMT::save_grid_mesh(std::string filename, const GridClip &clip)
+    {
+        ScopedTimer timer(stats(), trace(), STAGE_EXTRACTION);
+        // every tet kept by clip as its 4 faces
+        static const int tet_faces[4][3] = {{0, 2, 1}, {0, 3, 2}, {0, 1, 3}, {1, 2, 3}};
+        MeshFormat format = mesh_format(filename);
+        index_t nb_cells = delaunay_->nb_finite_cells();
+        std::vector<char> inside = clip_points(clip);
+
+        if (format == MESH_OBJ)
         {
-            std::vector<int> v_indices;
-            bool flag = false;
-            for (index_t lv = 0; lv < 4; ++lv)
+            check_memory_budget(count_grids(clip) * 12 * sizeof(int));
+            std::vector<int> mesh_faces;
+            for (index_t i = 0; i < nb_cells; i++)
             {
-                int v = delaunay_->cell_vertex(i, lv);
-                double x = delaunay_->vertex_ptr(v)[0];
-
-                if (x < x_clip_plane)
+                if (!keeps_grid_tet(i, clip, inside))
+                    continue;
+                for (int f = 0; f < 4; f++)
                 {
-                    flag = true;
-                    break;
+                    for (int k = 0; k < 3; k++)
+                    {
+                        mesh_faces.push_back(delaunay_->cell_vertex(i, tet_faces[f][k]));
+                    }
                 }
-                v_indices.push_back(int(v));
             }
-            if (flag)
-                continue;
-            mesh_faces.push_back(v_indices);
+            if (!write_mesh(filename, point_positions_, mesh_faces))
+            {
+                throw std::runtime_error("MCMT::save_grid_mesh: cannot write " + filename);
+            }
+            return;
         }
-        return std::make_pair(mesh_vertices, mesh_faces);
 
+        // binary formats are written in place: count the kept tets per block,
+        // size and map the file, then every block writes its own slice
+        std::vector<size_t> offsets = count_grid_blocks(0, nb_cells, clip, inside);
+        index_t nb_blocks = index_t(offsets.size() - 1);
+        size_t nb_triangles = 4 * offsets[nb_blocks];
+
+        auto write_blocks = [&](const auto &set_triangle)
+        {
+            tbb::parallel_for(index_t(0), nb_blocks, [&](index_t b)
+                              {
+                                  size_t triangle = 4 * offsets[b];
+                                  for (index_t i = b * grid_block_size; i < std::min(nb_cells, (b + 1) * grid_block_size); i++)
+                                  {
+                                      if (!keeps_grid_tet(i, clip, inside))
+                                          continue;
+                                      for (int f = 0; f < 4; f++)
+                                      {
+                                          int v[3];
+                                          for (int k = 0; k < 3; k++)
+                                          {
+                                              v[k] = delaunay_->cell_vertex(i, tet_faces[f][k]);
+                                          }
+                                          set_triangle(triangle++, v);
+                                      }
+                                  }
+                              });
+        };
+
+        bool ok;
+        if (format == MESH_PLY)
+        {
+            MappedPly ply(filename, nb_points(), nb_triangles);
+            if (!ply.is_open())
+            {
+                throw std::runtime_error("MCMT::save_grid_mesh: cannot open " + filename);
+            }
+            tbb::parallel_for(tbb::blocked_range<index_t>(0, nb_points()), [&](tbb::blocked_range<index_t> r)
+                              {
+                                  for (index_t i = r.begin(); i < r.end(); i++)
+                                  {
+                                      ply.set_vertex(i, point_positions_.data() + i * 3);
+                                  }
+                              });
+            write_blocks([&](size_t t, const int *v)
+                         { ply.set_triangle(t, v[0], v[1], v[2]); });
+            ok = ply.close();
+        }
+        else
+        {
+            MappedStl stl(filename, nb_triangles);
+            if (!stl.is_open())
+            {
+                throw std::runtime_error("MCMT::save_grid_mesh: cannot open " + filename);
+            }
+            const double *p = point_positions_.data();
+            write_blocks([&](size_t t, const int *v)
+                         { stl.set_triangle(t, p + v[0] * 3, p + v[1] * 3, p + v[2] * 3); });
+            ok = stl.close();
+        }
+        if (!ok)
+        {
+            throw std::runtime_error("MCMT::save_grid_mesh: cannot write " + filename);
+        }
+    }
+
+    std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>>
+    MCMT::get_grid_mesh(float x_clip_plane)
+    {
+        return get_grid_mesh(GridClip::x_plane(x_clip_plane));
+    }
+
+    std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>>
+    MCMT::get_grid_mesh(const GridClip &clip)
+    {
+        size_t nb_tets = count_grids(clip);
+        size_t nested_bytes = (nb_points() + nb_tets) * nested_vector_bytes + size_t(nb_points()) * 3 * sizeof(double) + nb_tets * 4 * sizeof(int);
+        check_memory_budget(nested_bytes + nb_tets * 4 * sizeof(int));
+        track_memory(0, nested_bytes);
+        std::vector<std::vector<double>> mesh_vertices(nb_points());
+        for (index_t i = 0; i < nb_points(); i++)
+        {
+            mesh_vertices[i].assign(point_positions_.begin() + i * 3, point_positions_.begin() + i * 3 + 3);
+        }
+        std::vector<int> tets = get_grids(clip);
+        std::vector<std::vector<int>> mesh_tets(tets.size() / 4);
+        for (size_t i = 0; i < mesh_tets.size(); i++)
+        {
+            mesh_tets[i].assign(tets.begin() + i * 4, tets.begin() + i * 4 + 4);
+        }
+        return std::make_pair(mesh_vertices, mesh_tets);
     }
 
 }
@@ -22,10 +22,109 @@
 #include <geogram/voronoi/integration_simplex.h>
 #include <geogram/voronoi/convex_cell.h>
 #include <algorithm>
+#include <limits>
+#include <functional>
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include "tet_kernels.hpp"
+#include "mcmt_stats.hpp"
+#include "mesh_io.hpp"
+#include "mesh_cleanup.hpp"
+
+class KDTree;
+class PointIndex;
 
 namespace GEO
 {
 
+	struct SamplingStats
+	{
+		size_t num_proposed = 0;
+		size_t num_accepted = 0;
+		size_t num_envelope_blocks = 0;
+		double acceptance_rate = 0;
+	};
+
+	enum LloydMode
+	{
+		// relax on the triangulation of all the points
+		LLOYD_GLOBAL,
+		// relax on a sub-triangulation of the relaxed points and the frozen
+		// points whose cells can touch theirs, grown as the points move. Same
+		// steps as LLOYD_GLOBAL, the L-BFGS energy only approximates the frozen
+		// border cells. Periodic domains use the whole grid
+		LLOYD_LOCAL
+	};
+
+	// how relaxation keeps points inside a non-periodic domain, periodic
+	// domains always wrap. Saved in state files, load_state accepts up to
+	// BOUNDARY_REFLECT
+	enum BoundaryMode
+	{
+		BOUNDARY_CLAMP,
+		BOUNDARY_REFLECT
+	};
+
+	enum ExtractionMode
+	{
+		// one to two triangles per crossed tet, on the crossed edges
+		EXTRACTION_MARCHING_TETS,
+		// dual contouring: one vertex per crossed tet at the minimizer of the
+		// QEF of its edge crossings, one polygon per crossed edge. Keeps sharp
+		// edges and corners of the surface
+		EXTRACTION_DUAL
+	};
+
+	// tets kept by the grid exports. A vertex passes when it lies in every
+	// half space, box and sphere; a tet is kept when all of its vertices pass
+	// (any of them unless whole_tets) and, with iso_crossing, when its values
+	// straddle iso_value
+	struct GridClip
+	{
+		// {nx, ny, nz, d}, keeps n . p >= d
+		std::vector<std::array<double, 4>> planes;
+		// {min x, y, z, max x, y, z}
+		std::vector<std::array<double, 6>> boxes;
+		// {center x, y, z, radius}
+		std::vector<std::array<double, 4>> spheres;
+		bool whole_tets = true;
+		bool iso_crossing = false;
+		double iso_value = 0.0;
+
+		// the single clip plane of the original exports
+		static GridClip x_plane(double x_clip_plane)
+		{
+			GridClip clip;
+			clip.planes.push_back({1.0, 0.0, 0.0, x_clip_plane});
+			return clip;
+		}
+
+		bool contains(const double *p) const
+		{
+			for (const std::array<double, 4> &plane : planes)
+			{
+				if (plane[0] * p[0] + plane[1] * p[1] + plane[2] * p[2] < plane[3])
+					return false;
+			}
+			for (const std::array<double, 6> &box : boxes)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					if (p[c] < box[c] || p[c] > box[c + 3])
+						return false;
+				}
+			}
+			for (const std::array<double, 4> &sphere : spheres)
+			{
+				double dx = p[0] - sphere[0], dy = p[1] - sphere[1], dz = p[2] - sphere[2];
+				if (dx * dx + dy * dy + dz * dz > sphere[3] * sphere[3])
+					return false;
+			}
+			return true;
+		}
+	};
+
 	class MCMT
 	{
 	public:
@@ -33,50 +132,237 @@ namespace GEO
 		~MCMT();
 
 		void clear();
+		// checkpoint of the points, values, errors, volumes and domain in a
+		// versioned binary file, the triangulation is rebuilt on load
+		void save_state(const std::string &filename) const;
+		void load_state(const std::string &filename);
 
+		void set_domain(const double *min_corner, const double *max_corner);
+		void get_domain(double *min_corner, double *max_corner) const;
+		// periodic meshing of the domain set by set_domain, which must be a
+		// cube [0, L]^3 with period L. Call before adding points
+		void set_periodic(bool periodic);
+		bool is_periodic() const { return periodic_; }
+		void set_boundary_mode(BoundaryMode mode) { boundary_mode_ = mode; }
 		void add_points(int num_points, double *point_positions, double *point_values);
 		void add_mid_points(int num_points, double *point_positions, double *point_values);
 		std::vector<double> get_mid_points();
 		std::vector<double> get_grid_points();
-		std::vector<int> get_grids();
+		// tets as 4 vertex indices each, only the ones kept by clip, i.e. all
+		// tets by default
+		std::vector<int> get_grids(const GridClip &clip = GridClip());
+		size_t count_grids(const GridClip &clip = GridClip());
+		// writes the tets into a preallocated array of capacity tets, throws when
+		// they do not fit. Returns the number of tets written
+		size_t copy_grids(int *tets, size_t capacity, const GridClip &clip = GridClip());
+		// hands the tets in cell order to sink, in blocks taken from at most
+		// block_cells cells. The block is only valid during the call
+		void stream_grids(const std::function<void(const int *, size_t)> &sink, const GridClip &clip = GridClip(),
+						  size_t block_cells = 1 << 20);
+		// raw int32 file of 4 indices per tet, host byte order
+		void save_grids(const std::string &filename, const GridClip &clip = GridClip());
+		// empty when [min_value, max_value]^3 misses the domain box
 		std::vector<double> sample_points_rejection(int num_samples, double min_value, double max_value);
 		// std::vector<double> sample_points(int num_samples);
-		std::vector<double> lloyd_relaxation(double *point_positions, int num_points, int num_iter);
+		// num_iter is the maximum number of iterations, relaxation stops earlier
+		// once no point moves by more than tolerance. density_weighted moves the
+		// points to the centroids of their cells under the point_errors_ density
+		std::vector<double> lloyd_relaxation(double *point_positions, int num_points, int num_iter, LloydMode mode = LLOYD_GLOBAL,
+											 bool density_weighted = false, double tolerance = 0.0);
+		// minimizes the CVT energy of the relaxed points with L-BFGS, each
+		// energy evaluation costs one triangulation
+		std::vector<double> lbfgs_relaxation(double *point_positions, int num_points, int max_iter, LloydMode mode = LLOYD_GLOBAL,
+											 bool density_weighted = false, double tolerance = 0.0);
+		// the writers pick binary PLY, binary STL or ASCII OBJ from the extension
+		// and throw std::runtime_error when the file cannot be written
 		void output_grid_points(std::string filename);
 		void save_triangle_mesh(std::string filename);
 		void save_grid_mesh(std::string filename, float x_clip_plane);
+		void save_grid_mesh(std::string filename, const GridClip &clip);
 		std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>> get_triangle_mesh();
+		// gradients of the SDF at a batch of n points, 3 per point
+		typedef std::function<void(size_t, const double *, double *)> GradientFunction;
+		// values of the SDF at a batch of n points
+		typedef std::function<void(size_t, const double *, double *)> SDFFunction;
+		void set_extraction_mode(ExtractionMode mode) { extraction_mode_ = mode; }
+		// opt-in refinement of the extracted vertices along their grid edges by
+		// num_steps secant / bisection steps, each one sdf call for the whole
+		// mesh. Vertices with |sdf| <= tolerance stop early. An empty sdf or
+		// num_steps <= 0 disables it
+		void set_surface_refinement(const SDFFunction &sdf, int num_steps, double tolerance = 0.0)
+		{
+			refinement_sdf_ = sdf;
+			refinement_steps_ = num_steps;
+			refinement_tolerance_ = tolerance;
+		}
+		// flat extracted mesh with a unit normal per vertex, along the SDF
+		// gradient: estimated by least squares over the Delaunay neighborhood
+		// of the crossed edges, or queried from gradient in one batch
+		void get_triangle_mesh(std::vector<double> &vertices, std::vector<int> &faces, std::vector<double> &normals,
+							   const GradientFunction &gradient = GradientFunction());
+		void get_triangle_mesh(std::vector<double> &vertices, std::vector<int> &faces) { extract_triangle_mesh(vertices, faces); }
+		// opt-in post-pass of the extracted triangle meshes: welding, removal
+		// of degenerate faces and unreferenced vertices, cache friendly order
+		void set_mesh_cleanup(bool enable, const MeshCleanupOptions &options = MeshCleanupOptions())
+		{
+			mesh_cleanup_ = enable;
+			mesh_cleanup_options_ = options;
+		}
 		std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>> get_grid_mesh(float x_clip_plane);
+		std::pair<std::vector<std::vector<double>>, std::vector<std::vector<int>>> get_grid_mesh(const GridClip &clip);
 
 		std::vector<double> sample_points_voronoi(const int num_points);
 
+		const SamplingStats &get_sampling_stats() const { return sampling_stats_; }
+
+		// opt-in stage timers and counters, off by default
+		void enable_stats(bool enable) { stats_enabled_ = enable; }
+		const MCMTStats &get_stats() const { return stats_; }
+		void reset_stats()
+		{
+			stats_ = MCMTStats();
+			memory_usage_ = MemoryUsage();
+		}
+		// opt-in timeline of the stages and of their TBB tasks
+		void enable_trace(bool enable);
+		bool save_trace(const std::string &filename) const;
+
+		MemoryUsage get_memory_usage();
+		// insertions, relaxations, sampling, mid points and extractions that
+		// would grow MCMT and their scratch or output beyond budget_bytes first
+		// drop caches, then throw std::runtime_error. 0 means no budget
+		void set_memory_budget(size_t budget_bytes) { memory_budget_ = budget_bytes; }
+		// drops the caches and shrinks the point store to fit
+		void compact();
+
 	private:
 		PeriodicDelaunay3d *delaunay_;
+		// scratch triangulation of lloyd_relaxation
+		PeriodicDelaunay3d *lloyd_delaunay_ = nullptr;
 		// PeriodicDelaunay3d::IncidentTetrahedra W_;
 		bool periodic_ = false;
-		double max_bound = 0;
-		double min_bound = 0;
+		double period_ = 1.0;
+		BoundaryMode boundary_mode_ = BOUNDARY_CLAMP;
+		// axis aligned meshing domain, grown from the inserted points unless
+		// set_domain was called
+		bool fixed_domain_ = false;
+		double domain_min_[3] = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+		double domain_max_[3] = {-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()};
 		int num_point_visited_ = 0;
 		std::vector<double> point_positions_;
 		std::vector<double> point_values_;
 		std::vector<double> point_errors_;
 		std::vector<double> point_volumes_;
 		std::vector<bool> volume_changed_;
+		std::vector<unsigned char> on_boundary_;
+		// nearest-neighbour index of point_positions_, extended as points are
+		// appended and dropped when they are replaced
+		std::unique_ptr<PointIndex> point_index_;
+		SamplingStats sampling_stats_;
+		bool stats_enabled_ = false;
+		MCMTStats stats_;
+
+		std::unique_ptr<TraceRecorder> trace_;
+		size_t memory_budget_ = 0;
+		MemoryUsage memory_usage_;
+		bool mesh_cleanup_ = false;
+		MeshCleanupOptions mesh_cleanup_options_;
+		ExtractionMode extraction_mode_ = EXTRACTION_MARCHING_TETS;
+		SDFFunction refinement_sdf_;
+		int refinement_steps_ = 0;
+		double refinement_tolerance_ = 0.0;
+
+		MCMTStats *stats() { return stats_enabled_ ? &stats_ : nullptr; }
+		TraceRecorder *trace() const { return trace_.get(); }
+		void count(Counter counter, size_t n)
+		{
+			if (stats_enabled_)
+				stats_.counters[counter] += n;
+		}
+
+		// axis aligned block of the rejection sampling envelope, bound is an
+		// upper bound of the density inside the block
+		struct EnvelopeBlock
+		{
+			double min_corner[3];
+			double size[3];
+			double bound;
+			double volume() const { return size[0] * size[1] * size[2]; }
+		};
+		std::vector<EnvelopeBlock> build_density_envelope(const KDTree &tree, const double *min_corner, const double *max_corner);
 
-		std::vector<double> sample_tet(std::vector<double> point_positions);
 		std::vector<double> compute_tet_error();
-		std::vector<double> sample_polytope(int vertex_index);
+		// num_samples uniform samples of the cell of vertex_index, one TetBatch draw
+		void sample_polytope(int vertex_index, size_t num_samples, double *points);
 		std::vector<double> compute_voronoi_error();
 
-		double tetrahedronVolume(const std::vector<double> &coordinates);
 		void save_face(std::ofstream &output_mesh, const std::vector<double> &points, int &vertex_count);
+		// marching tets, xyz triplets and index triplets
+		// normals, when given, get one unit normal per vertex
+		void extract_triangle_mesh(std::vector<double> &mesh_vertices, std::vector<int> &mesh_faces, std::vector<double> *normals = nullptr,
+								   const GradientFunction &gradient = GradientFunction());
+		// EXTRACTION_DUAL path of extract_triangle_mesh, before the cleanup
+		void extract_dual_mesh(std::vector<double> &mesh_vertices, std::vector<int> &mesh_faces, std::vector<double> *normals,
+							   const GradientFunction &gradient);
+		// tets with an edge whose values change sign
+		bool crosses_surface(index_t t) const;
+		// least-squares SDF gradient at point v from its Delaunay neighbors
+		void estimate_gradient(index_t v, double *gradient) const;
+		// moves the vertices placed on the grid edges vertex_edges to the zero
+		// crossing of refinement_sdf_
+		void refine_vertices(const std::vector<std::pair<int, int>> &vertex_edges, std::vector<double> &mesh_vertices);
+		// normals of the vertices placed on the grid edges vertex_edges
+		void compute_normals(const std::vector<std::pair<int, int>> &vertex_edges, const std::vector<double> &mesh_vertices,
+							 std::vector<double> &normals, const GradientFunction &gradient) const;
 		index_t nb_points() const
 		{
 			return index_t(point_positions_.size() / 3);
 		}
+		PeriodicDelaunay3d *create_delaunay() const;
+		// set_vertices + compute, timed as STAGE_DELAUNAY
+		void compute_delaunay(PeriodicDelaunay3d *delaunay, index_t nb_vertices, const double *vertices);
 		void get_cell(index_t v, ConvexCell &C, PeriodicDelaunay3d::IncidentTetrahedra& W);
+		void get_cell(const PeriodicDelaunay3d *delaunay, index_t v, ConvexCell &C, PeriodicDelaunay3d::IncidentTetrahedra& W) const;
+		// merges into the sorted frozen_ids the frozen points whose cells can
+		// touch the cells of the relaxed points, returns whether it grew
+		bool get_lloyd_neighbourhood(const double *relaxed_point_positions, int num_points, std::vector<index_t> &frozen_ids);
+		// the frozen points (all of them when local is false) followed by the relaxed points
+		std::vector<double> get_lloyd_points(bool local, const std::vector<index_t> &frozen_ids, const double *relaxed_point_positions, int num_points) const;
+		void get_cell_tets(const ConvexCell &C, const vec3 &apex, TetBatch &tetrahedrons) const;
+		void integrate_cell(const ConvexCell &C, const KDTree *density, TetBatch &tetrahedrons, std::vector<double> &volumes, double &mass, vec3 &centroid,
+							const double *site = nullptr, double *energy = nullptr) const;
+		// CVT energies of the cells of the frozen points [0, first_free) on their own
+		std::vector<double> frozen_cell_energies(PeriodicDelaunay3d *delaunay, const std::vector<double> &all_points, index_t first_free,
+												 const KDTree *density);
+		// CVT energy relative to frozen_energies and its gradient in the free points
+		double evaluate_cvt(PeriodicDelaunay3d *delaunay, const std::vector<double> &all_points, index_t first_free, const KDTree *density,
+							const std::vector<double> &frozen_energies, std::vector<double> &gradient, std::vector<double> &masses);
+		void update_domain(index_t first_point);
+		// throws when extra_bytes do not fit in the memory budget, even after compact()
+		void check_memory_budget(size_t extra_bytes);
+		// refreshes memory_usage_ and its peak, with the transient KD-tree and
+		// output mesh of the current call
+		void track_memory(size_t kdtree_bytes = 0, size_t mesh_bytes = 0);
+		double check_periodic_domain() const;
+		// moves p back into the domain
+		void constrain_point(double *p) const;
+		// a - b along one axis, the shortest image in periodic mode. The
+		// period is the same on every axis
+		double difference(double a, double b) const;
 
-		std::vector<double> compute_face_mid_point(int num_points, const std::vector<double> &points);
 		std::vector<double> interpolate(double *point1, double *point2, double sd1, double sd2);
+		void interpolate(const double *point1, const double *point2, double sd1, double sd2, double *point) const;
+		bool compute_mid_point(index_t t, double *mid_point) const;
+		bool touches_boundary(index_t t) const;
+		// GridClip::contains of every point, evaluated once per export
+		std::vector<char> clip_points(const GridClip &clip) const;
+		bool keeps_grid_tet(index_t t, const GridClip &clip, const std::vector<char> &inside) const;
+		// prefix sums of the kept tets of [begin, end), per block of grid cells
+		std::vector<size_t> count_grid_blocks(index_t begin, index_t end, const GridClip &clip, const std::vector<char> &inside) const;
+		// writes the kept tets of [begin, end) at the offsets of count_grid_blocks
+		void fill_grid_blocks(index_t begin, index_t end, const std::vector<size_t> &offsets, const GridClip &clip,
+							  const std::vector<char> &inside, int *tets) const;
+		// tets of a periodic triangulation with a vertex copy span the period
+		bool crosses_period(index_t t) const;
 	};
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <sstream>
 #include <set>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <tbb/tbb.h>
 #include "KDTreeVectorOfVectorsAdaptor.hpp"
@@ -13,6 +14,8 @@
 class KDTree
 {
 public:
+    typedef KDTreeVectorOfVectorsAdaptor<std::vector<std::vector<double>>, double> my_kd_tree_t;
+
     KDTree(int num_points, double *point_positions, double *point_values)
     {
         for (int i = 0; i < num_points; i++)
@@ -26,19 +29,19 @@ public:
             point.push_back(point_values[i]);
             kdtree_point_positions.push_back(point);
         }
+        // the adaptor builds its index on construction, build it once here
+        // instead of once per query batch
+        tree.reset(new my_kd_tree_t(3, kdtree_point_positions, 10 /* max leaf */));
     }
     ~KDTree()
     {
+        tree.reset();
         kdtree_point_positions.clear();
         kdtree_point_values.clear();
     }
 
     std::vector<double> compute_density(int num_points, double *point_positions)
     {
-        typedef KDTreeVectorOfVectorsAdaptor<std::vector<std::vector<double>>, double> my_kd_tree_t;
-
-        my_kd_tree_t tree(3, kdtree_point_positions, 10 /* max leaf */);
-        tree.index->buildIndex();
         std::vector<double> densities;
         densities.resize(num_points);
         tbb::parallel_for(tbb::blocked_range<int>(0, num_points),
@@ -46,20 +49,131 @@ public:
                         {
                             for(int i = ti.begin(); i < ti.end(); i++)
                             {
-                                nanoflann::KNNResultSet<double> resultSet(1);
-                                std::vector<size_t> ret_indexes(1);
-                                std::vector<double> out_dists_sqr(1);
-                                resultSet.init(&ret_indexes[0], &out_dists_sqr[0]);
-                                tree.index->findNeighbors(resultSet, point_positions + i * 3, nanoflann::SearchParameters(10));
-                                densities[i] = kdtree_point_values[ret_indexes[0]];
+                                size_t ret_index;
+                                double out_dist_sqr;
+                                nearest(point_positions + i * 3, ret_index, out_dist_sqr);
+                                densities[i] = kdtree_point_values[ret_index];
                             }
                         });
 
         return densities;
     }
 
+    double density(const double *point_position) const
+    {
+        size_t ret_index;
+        double out_dist_sqr;
+        nearest(point_position, ret_index, out_dist_sqr);
+        return kdtree_point_values[ret_index];
+    }
+
+    // Upper bound of the nearest-neighbour density over the ball B(center, radius).
+    // The nearest-neighbour distance is 1-Lipschitz, so the nearest site of any
+    // query in the ball lies within d(center) + 2 * radius of the center.
+    // Queries are exact so that compute_density never exceeds this bound.
+    double max_density(const double *center, double radius) const
+    {
+        size_t ret_index;
+        double out_dist_sqr;
+        nearest(center, ret_index, out_dist_sqr);
+
+        double search_radius = std::sqrt(out_dist_sqr) + 2.0 * radius;
+        std::vector<nanoflann::ResultItem<size_t, double>> matches;
+        tree->index->radiusSearch(center, search_radius * search_radius, matches, nanoflann::SearchParameters(0, false));
+
+        double max_value = kdtree_point_values[ret_index];
+        for (size_t i = 0; i < matches.size(); i++)
+        {
+            max_value = std::max(max_value, kdtree_point_values[matches[i].first]);
+        }
+        return max_value;
+    }
+
+    // k nearest points, returns the number of points found
+    size_t nearest(const double *query_point, size_t k, size_t *ret_indices, double *out_dists_sqr) const
+    {
+        nanoflann::KNNResultSet<double> resultSet(k);
+        resultSet.init(ret_indices, out_dists_sqr);
+        tree->index->findNeighbors(resultSet, query_point, nanoflann::SearchParameters());
+        return resultSet.size();
+    }
+
+    // bytes held by the copied points, their values and the index
+    size_t memory_bytes() const
+    {
+        return kdtree_point_positions.capacity() * sizeof(std::vector<double>) + kdtree_point_positions.size() * 4 * sizeof(double) +
+               kdtree_point_values.capacity() * sizeof(double) + tree->index->usedMemory(*tree->index);
+    }
+
 private:
+    void nearest(const double *query_point, size_t &ret_index, double &out_dist_sqr) const
+    {
+        nanoflann::KNNResultSet<double> resultSet(1);
+        resultSet.init(&ret_index, &out_dist_sqr);
+        tree->index->findNeighbors(resultSet, query_point, nanoflann::SearchParameters());
+    }
+
     std::vector<std::vector<double>> kdtree_point_positions;
     std::vector<double> kdtree_point_values;
-    int num_points;
+    std::unique_ptr<my_kd_tree_t> tree;
+};
+
+// nearest-neighbour index over a flat array of 3D points that only grows,
+// update() indexes the points appended since the last call instead of
+// rebuilding everything. The array must outlive the index
+class PointIndex
+{
+public:
+    explicit PointIndex(const std::vector<double> &points)
+        : cloud_{&points}, index_(3, cloud_, nanoflann::KDTreeSingleIndexAdaptorParams(10)), indexed_(cloud_.kdtree_get_point_count())
+    {
+    }
+
+    PointIndex(const PointIndex &) = delete;
+    PointIndex &operator=(const PointIndex &) = delete;
+
+    size_t size() const { return indexed_; }
+
+    void update()
+    {
+        size_t num_points = cloud_.kdtree_get_point_count();
+        if (num_points > indexed_)
+        {
+            index_.addPoints(uint32_t(indexed_), uint32_t(num_points - 1));
+            indexed_ = num_points;
+        }
+    }
+
+    // k nearest points, returns the number of points found
+    size_t nearest(const double *query_point, size_t k, size_t *ret_indices, double *out_dists_sqr) const
+    {
+        std::vector<uint32_t> indices(k);
+        nanoflann::KNNResultSet<double, uint32_t> resultSet(k);
+        resultSet.init(indices.data(), out_dists_sqr);
+        index_.findNeighbors(resultSet, query_point, nanoflann::SearchParameters());
+        size_t num_found = resultSet.size();
+        std::copy(indices.begin(), indices.begin() + num_found, ret_indices);
+        return num_found;
+    }
+
+    // estimate: per point a tree slot, a permutation entry and its share of the nodes
+    size_t memory_bytes() const
+    {
+        return indexed_ * 20;
+    }
+
+private:
+    struct Cloud
+    {
+        const std::vector<double> *points;
+        size_t kdtree_get_point_count() const { return points->size() / 3; }
+        double kdtree_get_pt(size_t i, size_t d) const { return (*points)[i * 3 + d]; }
+        template <class BBOX>
+        bool kdtree_get_bbox(BBOX &) const { return false; }
+    };
+    typedef nanoflann::KDTreeSingleIndexDynamicAdaptor<nanoflann::L2_Simple_Adaptor<double, Cloud>, Cloud, 3> Index;
+
+    Cloud cloud_;
+    Index index_;
+    size_t indexed_;
 };
@@ -24,7 +24,7 @@ int main(int argc, char **argv)
         }
     }
 
-    MCMT mcmt = MCMT();
+    MCMT mcmt;
     // // mcmt.clear();
     std::vector<double> point_values;
     for (int i = 0; i < points.size() / 3; i++)
@@ -0,0 +1,228 @@
+#include "fast_mcmt.hpp"
+#include "sdfs.hpp"
+
+#include <benchmark/benchmark.h>
+#include <tbb/global_control.h>
+#include <cstdio>
+#include <thread>
+
+// Microbenchmarks of the MCMT kernels on the sdBox field of the unit cube.
+// Every benchmark takes {num_points, num_threads}; run with
+//   mcmt_bench --benchmark_format=json --benchmark_out=mcmt_bench.json
+// to track regressions.
+
+namespace
+{
+    using namespace GEO;
+
+    const int num_samples = 4096;
+
+    std::vector<double> random_points(int num_points, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::vector<double> points(num_points * 3);
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            points[i] = uniform(rng);
+        }
+        return points;
+    }
+
+    std::vector<double> evaluate_sdf(const std::vector<double> &points)
+    {
+        std::vector<double> values(points.size() / 3);
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            values[i] = SDF::sdBox(points[i * 3], points[i * 3 + 1], points[i * 3 + 2]);
+        }
+        return values;
+    }
+
+    // corners of the unit cube followed by uniform points, as McGrids starts
+    std::vector<double> initial_points(int num_points)
+    {
+        std::vector<double> points;
+        for (int i = 0; i < 8; i++)
+        {
+            points.push_back(i & 1 ? 1.0 : 0.0);
+            points.push_back(i & 2 ? 1.0 : 0.0);
+            points.push_back(i & 4 ? 1.0 : 0.0);
+        }
+        std::vector<double> samples = random_points(num_points - 8, 1);
+        points.insert(points.end(), samples.begin(), samples.end());
+        return points;
+    }
+
+    void setup(MCMT &mcmt, int num_points)
+    {
+        const double min_corner[3] = {0.0, 0.0, 0.0};
+        const double max_corner[3] = {1.0, 1.0, 1.0};
+        mcmt.clear();
+        mcmt.set_domain(min_corner, max_corner);
+        std::vector<double> points = initial_points(num_points);
+        std::vector<double> values = evaluate_sdf(points);
+        mcmt.add_points(points.size() / 3, points.data(), values.data());
+    }
+
+    void scaling_args(benchmark::internal::Benchmark *b)
+    {
+        int max_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int n = 1 << 12; n <= 1 << 18; n <<= 3)
+        {
+            for (int t = 1; t < max_threads; t *= 2)
+            {
+                b->Args({n, t});
+            }
+            b->Args({n, max_threads});
+        }
+        b->ArgNames({"points", "threads"});
+        b->Unit(benchmark::kMillisecond);
+    }
+
+    // checkpoint sizes of the resume benchmarks, up to a 5M point run
+    void resume_args(benchmark::internal::Benchmark *b)
+    {
+        int max_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int n : {1 << 20, 5000000})
+        {
+            b->Args({n, max_threads});
+        }
+        b->ArgNames({"points", "threads"});
+        b->Unit(benchmark::kMillisecond);
+        b->Iterations(3);
+    }
+}
+
+static void BM_add_points(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    std::vector<double> points = initial_points(state.range(0));
+    std::vector<double> values = evaluate_sdf(points);
+    MCMT mcmt;
+    for (auto _ : state)
+    {
+        mcmt.clear();
+        mcmt.add_points(points.size() / 3, points.data(), values.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_add_points)->Apply(scaling_args);
+// the baseline of BM_load_state, rebuilding from the points in sampling order
+BENCHMARK(BM_add_points)->Apply(resume_args);
+
+static void BM_load_state(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    const std::string filename = "mcmt_bench_state.bin";
+    {
+        MCMT mcmt;
+        setup(mcmt, state.range(0));
+        mcmt.save_state(filename);
+    }
+    MCMT mcmt;
+    for (auto _ : state)
+    {
+        mcmt.load_state(filename);
+    }
+    std::remove(filename.c_str());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_load_state)->Apply(resume_args);
+
+static void BM_add_mid_points(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    MCMT mcmt;
+    size_t num_mid_points = 0;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        setup(mcmt, state.range(0));
+        std::vector<double> mid_points = mcmt.get_mid_points();
+        std::vector<double> values = evaluate_sdf(mid_points);
+        num_mid_points += values.size();
+        state.ResumeTiming();
+        mcmt.add_mid_points(values.size(), mid_points.data(), values.data());
+    }
+    state.SetItemsProcessed(num_mid_points);
+}
+BENCHMARK(BM_add_mid_points)->Apply(scaling_args);
+
+static void BM_get_mid_points(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    MCMT mcmt;
+    setup(mcmt, state.range(0));
+    size_t num_mid_points = 0;
+    for (auto _ : state)
+    {
+        std::vector<double> mid_points = mcmt.get_mid_points();
+        num_mid_points += mid_points.size() / 3;
+        benchmark::DoNotOptimize(mid_points.data());
+    }
+    state.SetItemsProcessed(num_mid_points);
+}
+BENCHMARK(BM_get_mid_points)->Apply(scaling_args);
+
+static void BM_sample_points_voronoi(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    MCMT mcmt;
+    setup(mcmt, state.range(0));
+    for (auto _ : state)
+    {
+        std::vector<double> samples = mcmt.sample_points_voronoi(num_samples);
+        benchmark::DoNotOptimize(samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK(BM_sample_points_voronoi)->Apply(scaling_args);
+
+static void BM_sample_points_rejection(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    MCMT mcmt;
+    setup(mcmt, state.range(0));
+    for (auto _ : state)
+    {
+        std::vector<double> samples = mcmt.sample_points_rejection(num_samples, 0.0, 1.0);
+        benchmark::DoNotOptimize(samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * num_samples);
+    state.counters["acceptance_rate"] = mcmt.get_sampling_stats().acceptance_rate;
+}
+BENCHMARK(BM_sample_points_rejection)->Apply(scaling_args);
+
+static void BM_lloyd_relaxation(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    MCMT mcmt;
+    setup(mcmt, state.range(0));
+    std::vector<double> samples = random_points(num_samples, 2);
+    for (auto _ : state)
+    {
+        std::vector<double> relaxed = mcmt.lloyd_relaxation(samples.data(), num_samples, 1, LLOYD_LOCAL);
+        benchmark::DoNotOptimize(relaxed.data());
+    }
+    state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK(BM_lloyd_relaxation)->Apply(scaling_args);
+
+static void BM_get_triangle_mesh(benchmark::State &state)
+{
+    tbb::global_control threads(tbb::global_control::max_allowed_parallelism, state.range(1));
+    MCMT mcmt;
+    setup(mcmt, state.range(0));
+    size_t num_faces = 0;
+    for (auto _ : state)
+    {
+        auto mesh = mcmt.get_triangle_mesh();
+        num_faces = mesh.second.size();
+        benchmark::DoNotOptimize(mesh.first.data());
+    }
+    state.counters["faces"] = num_faces;
+}
+BENCHMARK(BM_get_triangle_mesh)->Apply(scaling_args);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <tbb/enumerable_thread_specific.h>
+
+namespace GEO
+{
+	enum Stage
+	{
+		STAGE_ADD_POINTS,
+		STAGE_ADD_MID_POINTS,
+		STAGE_DELAUNAY,
+		STAGE_CELL_VOLUMES,
+		STAGE_MID_POINTS,
+		STAGE_SAMPLING,
+		STAGE_RELAXATION,
+		STAGE_EXTRACTION,
+		STAGE_REFINEMENT,
+		NUM_STAGES
+	};
+
+	enum Counter
+	{
+		COUNTER_POINTS_INSERTED,
+		COUNTER_TETS_CREATED,
+		COUNTER_CANDIDATES,
+		COUNTER_MID_POINTS,
+		COUNTER_CELLS_RECOMPUTED,
+		// values handed to add_points / add_mid_points and queried by the
+		// surface refinement, i.e. SDF evaluations
+		COUNTER_SDF_VALUES,
+		NUM_COUNTERS
+	};
+
+	// per-stage wall time and counters accumulated since the last reset,
+	// stages nest (e.g. STAGE_DELAUNAY runs inside STAGE_ADD_POINTS)
+	struct MCMTStats
+	{
+		double stage_seconds[NUM_STAGES] = {};
+		size_t stage_calls[NUM_STAGES] = {};
+		size_t counters[NUM_COUNTERS] = {};
+
+		static const char *stage_name(int stage)
+		{
+			static const char *names[NUM_STAGES] = {"add_points", "add_mid_points", "delaunay", "cell_volumes",
+													"mid_points", "sampling", "relaxation", "extraction", "refinement"};
+			return names[stage];
+		}
+
+		static const char *counter_name(int counter)
+		{
+			static const char *names[NUM_COUNTERS] = {"points_inserted", "tets_created", "candidates", "mid_points",
+													  "cells_recomputed", "sdf_values"};
+			return names[counter];
+		}
+	};
+
+	// bytes held by MCMT, the triangulations are estimated from their cell
+	// and vertex counts
+	struct MemoryUsage
+	{
+		size_t point_store = 0;
+		size_t triangulation = 0;
+		// scratch triangulation of the relaxations, dropped under memory pressure
+		size_t scratch_triangulation = 0;
+		// largest KD-tree built since the last reset, freed after each call
+		size_t kdtree = 0;
+		// largest extracted mesh or grid export since the last reset, owned
+		// by the caller once returned
+		size_t output_meshes = 0;
+		// cached nearest-neighbour index of the grid points
+		size_t point_index = 0;
+		// largest total seen since the last reset
+		size_t peak = 0;
+
+		size_t total() const { return point_store + triangulation + scratch_triangulation + point_index; }
+	};
+
+	// timeline of stages and TBB tasks, each thread appends to its own
+	// buffer. Names must be string literals
+	class TraceRecorder
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		TraceRecorder() : origin_(clock::now()) {}
+
+		void record(const char *name, clock::time_point begin, clock::time_point end, size_t count)
+		{
+			Event event;
+			event.name = name;
+			event.begin = std::chrono::duration<double, std::micro>(begin - origin_).count();
+			event.duration = std::chrono::duration<double, std::micro>(end - begin).count();
+			event.count = count;
+			events_.local().push_back(event);
+		}
+
+		void clear()
+		{
+			events_.clear();
+			origin_ = clock::now();
+		}
+
+		// Chrome trace event format, loads in chrome://tracing and Perfetto
+		bool write(const std::string &filename) const
+		{
+			std::ofstream out(filename);
+			if (!out)
+				return false;
+			out.setf(std::ios::fixed);
+			out.precision(3);
+			out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+			bool first = true;
+			int tid = 0;
+			for (auto it = events_.begin(); it != events_.end(); ++it, ++tid)
+			{
+				for (size_t e = 0; e < it->size(); e++)
+				{
+					const Event &event = (*it)[e];
+					out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"cat\":\"mcmt\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+						<< ",\"ts\":" << event.begin << ",\"dur\":" << event.duration << ",\"args\":{\"count\":" << event.count << "}}";
+					first = false;
+				}
+			}
+			out << "\n]}\n";
+			return bool(out);
+		}
+
+	private:
+		struct Event
+		{
+			const char *name;
+			double begin;
+			double duration;
+			size_t count;
+		};
+		tbb::enumerable_thread_specific<std::vector<Event>> events_;
+		clock::time_point origin_;
+	};
+
+	// traces the lifetime of the scope, e.g. the body of a TBB task
+	class TraceScope
+	{
+	public:
+		TraceScope(TraceRecorder *trace, const char *name, size_t count) : trace_(trace), name_(name), count_(count)
+		{
+			if (trace_)
+				start_ = TraceRecorder::clock::now();
+		}
+
+		~TraceScope()
+		{
+			if (trace_)
+				trace_->record(name_, start_, TraceRecorder::clock::now(), count_);
+		}
+
+		TraceScope(const TraceScope &) = delete;
+		TraceScope &operator=(const TraceScope &) = delete;
+
+	private:
+		TraceRecorder *trace_;
+		const char *name_;
+		size_t count_;
+		TraceRecorder::clock::time_point start_;
+	};
+
+	// adds the lifetime of the scope to a stage and to the trace, does
+	// nothing when both are disabled
+	class ScopedTimer
+	{
+	public:
+		ScopedTimer(MCMTStats *stats, TraceRecorder *trace, Stage stage) : stats_(stats), trace_(trace), stage_(stage)
+		{
+			if (stats_ || trace_)
+				start_ = std::chrono::steady_clock::now();
+		}
+
+		~ScopedTimer()
+		{
+			if (!stats_ && !trace_)
+				return;
+			std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+			if (stats_)
+			{
+				std::chrono::duration<double> elapsed = end - start_;
+				stats_->stage_seconds[stage_] += elapsed.count();
+				stats_->stage_calls[stage_]++;
+			}
+			if (trace_)
+			{
+				trace_->record(MCMTStats::stage_name(stage_), start_, end, 1);
+			}
+		}
+
+		ScopedTimer(const ScopedTimer &) = delete;
+		ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+	private:
+		MCMTStats *stats_;
+		TraceRecorder *trace_;
+		Stage stage_;
+		std::chrono::steady_clock::time_point start_;
+	};
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+namespace GEO
+{
+	struct MeshCleanupOptions
+	{
+		// vertices that snap to the same point of a grid of this spacing are
+		// merged, 0 merges exact duplicates only and < 0 disables welding. Not
+		// a distance threshold, close vertices across a grid boundary stay apart
+		double weld_tolerance = 0.0;
+		// faces with a repeated vertex or an area <= min_area are dropped
+		bool drop_degenerate = true;
+		double min_area = 0.0;
+		bool remove_unreferenced = true;
+		// vertices in Morton order, faces by their first vertex
+		bool reorder = true;
+	};
+
+	namespace MeshCleanup
+	{
+		// elements per parallel block of the compactions
+		const size_t block_size = 1 << 14;
+
+		// keeps the items i of [0, n) with keep(i), in order: returns the
+		// kept indices, counted and written per block
+		template <class Keep>
+		std::vector<size_t> select(size_t n, const Keep &keep)
+		{
+			size_t nb_blocks = (n + block_size - 1) / block_size;
+			std::vector<size_t> offsets(nb_blocks + 1, 0);
+			tbb::parallel_for(size_t(0), nb_blocks, [&](size_t b)
+							  {
+								  size_t kept = 0;
+								  for (size_t i = b * block_size; i < std::min(n, (b + 1) * block_size); i++)
+								  {
+									  kept += keep(i);
+								  }
+								  offsets[b + 1] = kept;
+							  });
+			for (size_t b = 0; b < nb_blocks; b++)
+			{
+				offsets[b + 1] += offsets[b];
+			}
+			std::vector<size_t> selected(offsets[nb_blocks]);
+			tbb::parallel_for(size_t(0), nb_blocks, [&](size_t b)
+							  {
+								  size_t k = offsets[b];
+								  for (size_t i = b * block_size; i < std::min(n, (b + 1) * block_size); i++)
+								  {
+									  if (keep(i))
+										  selected[k++] = i;
+								  }
+							  });
+			return selected;
+		}
+
+		// maps every vertex to the first vertex snapped to the same point of
+		// the grid of spacing tolerance. This is a snap and not a distance
+		// threshold: two vertices closer than tolerance on either side of a
+		// rounding boundary stay apart
+		inline std::vector<int> weld(const std::vector<double> &vertices, double tolerance)
+		{
+			size_t n = vertices.size() / 3;
+			std::vector<double> keys(vertices.size());
+			tbb::parallel_for(size_t(0), keys.size(), [&](size_t i)
+							  { keys[i] = tolerance > 0.0 ? std::round(vertices[i] / tolerance) : vertices[i] + 0.0; });
+			std::vector<int> order(n);
+			tbb::parallel_for(size_t(0), n, [&](size_t i)
+							  { order[i] = int(i); });
+			auto less = [&](int a, int b)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					if (keys[a * 3 + c] != keys[b * 3 + c])
+						return keys[a * 3 + c] < keys[b * 3 + c];
+				}
+				return a < b;
+			};
+			tbb::parallel_sort(order.begin(), order.end(), less);
+
+			// runs of equal keys, each one maps to its head, the smallest index
+			std::vector<size_t> runs = select(n, [&](size_t i)
+											  { return i == 0 || !std::equal(keys.begin() + order[i - 1] * 3, keys.begin() + order[i - 1] * 3 + 3, keys.begin() + order[i] * 3); });
+			runs.push_back(n);
+			std::vector<int> remap(n);
+			tbb::parallel_for(size_t(0), runs.size() - 1, [&](size_t r)
+							  {
+								  for (size_t i = runs[r]; i < runs[r + 1]; i++)
+								  {
+									  remap[order[i]] = order[runs[r]];
+								  }
+							  });
+			return remap;
+		}
+
+		// 63 bit Morton code of p in the box [min_corner, min_corner + extent]
+		inline uint64_t morton_code(const double *p, const double *min_corner, double extent)
+		{
+			uint64_t code = 0;
+			for (int c = 0; c < 3; c++)
+			{
+				double t = extent > 0.0 ? (p[c] - min_corner[c]) / extent : 0.0;
+				uint64_t x = uint64_t(std::min(std::max(t, 0.0), 1.0) * double((1 << 21) - 1));
+				for (int bit = 0; bit < 21; bit++)
+				{
+					code |= ((x >> bit) & 1) << (3 * bit + c);
+				}
+			}
+			return code;
+		}
+
+		inline std::vector<uint64_t> morton_codes(const std::vector<double> &vertices)
+		{
+			size_t n = vertices.size() / 3;
+			double min_corner[3], extent = 0.0;
+			for (int c = 0; c < 3; c++)
+			{
+				double lo = std::numeric_limits<double>::max(), hi = -std::numeric_limits<double>::max();
+				for (size_t i = 0; i < n; i++)
+				{
+					lo = std::min(lo, vertices[i * 3 + c]);
+					hi = std::max(hi, vertices[i * 3 + c]);
+				}
+				min_corner[c] = lo;
+				extent = std::max(extent, hi - lo);
+			}
+			std::vector<uint64_t> codes(n);
+			tbb::parallel_for(size_t(0), n, [&](size_t i)
+							  { codes[i] = morton_code(vertices.data() + i * 3, min_corner, extent); });
+			return codes;
+		}
+
+		inline double triangle_area(const double *a, const double *b, const double *c)
+		{
+			double ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+			double ac[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+			double n[3] = {ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0]};
+			return 0.5 * std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		}
+
+		// in place post-pass of an extracted triangle mesh, normals (3 per
+		// vertex) follow their vertices when given
+		inline void cleanup(std::vector<double> &vertices, std::vector<int> &triangles, const MeshCleanupOptions &options,
+							std::vector<double> *normals = nullptr)
+		{
+			size_t nv = vertices.size() / 3;
+			size_t nt = triangles.size() / 3;
+
+			if (options.weld_tolerance >= 0.0)
+			{
+				std::vector<int> remap = weld(vertices, options.weld_tolerance);
+				tbb::parallel_for(size_t(0), triangles.size(), [&](size_t i)
+								  { triangles[i] = remap[triangles[i]]; });
+			}
+
+			if (options.drop_degenerate)
+			{
+				std::vector<size_t> kept = select(nt, [&](size_t t)
+												  {
+													  const int *f = triangles.data() + t * 3;
+													  if (f[0] == f[1] || f[1] == f[2] || f[2] == f[0])
+														  return false;
+													  return triangle_area(vertices.data() + f[0] * 3, vertices.data() + f[1] * 3, vertices.data() + f[2] * 3) > options.min_area;
+												  });
+				std::vector<int> compacted(kept.size() * 3);
+				tbb::parallel_for(size_t(0), kept.size(), [&](size_t t)
+								  { std::copy_n(triangles.begin() + kept[t] * 3, 3, compacted.begin() + t * 3); });
+				triangles.swap(compacted);
+				nt = kept.size();
+			}
+
+			// new vertex order: the referenced vertices (all of them unless
+			// remove_unreferenced), in Morton order when reordering
+			std::vector<size_t> vertex_order;
+			if (options.remove_unreferenced)
+			{
+				std::vector<std::atomic<char>> referenced(nv);
+				tbb::parallel_for(size_t(0), triangles.size(), [&](size_t i)
+								  { referenced[triangles[i]].store(1, std::memory_order_relaxed); });
+				vertex_order = select(nv, [&](size_t v)
+									  { return referenced[v].load(std::memory_order_relaxed) != 0; });
+			}
+			else
+			{
+				vertex_order.resize(nv);
+				tbb::parallel_for(size_t(0), nv, [&](size_t v)
+								  { vertex_order[v] = v; });
+			}
+			if (options.reorder)
+			{
+				std::vector<uint64_t> codes = morton_codes(vertices);
+				tbb::parallel_sort(vertex_order.begin(), vertex_order.end(), [&](size_t a, size_t b)
+								   { return codes[a] < codes[b] || (codes[a] == codes[b] && a < b); });
+			}
+			if (!options.remove_unreferenced && !options.reorder)
+				return;
+
+			std::vector<int> new_index(nv, -1);
+			std::vector<double> new_vertices(vertex_order.size() * 3);
+			std::vector<double> new_normals(normals ? new_vertices.size() : 0);
+			tbb::parallel_for(size_t(0), vertex_order.size(), [&](size_t i)
+							  {
+								  new_index[vertex_order[i]] = int(i);
+								  std::copy_n(vertices.begin() + vertex_order[i] * 3, 3, new_vertices.begin() + i * 3);
+								  if (normals)
+									  std::copy_n(normals->begin() + vertex_order[i] * 3, 3, new_normals.begin() + i * 3);
+							  });
+			vertices.swap(new_vertices);
+			if (normals)
+				normals->swap(new_normals);
+			tbb::parallel_for(size_t(0), triangles.size(), [&](size_t i)
+							  { triangles[i] = new_index[triangles[i]]; });
+
+			if (options.reorder)
+			{
+				// faces sorted by their smallest vertex, rotated so that it comes
+				// first, which keeps the orientation
+				tbb::parallel_for(size_t(0), nt, [&](size_t t)
+								  {
+									  int *f = triangles.data() + t * 3;
+									  std::rotate(f, std::min_element(f, f + 3), f + 3);
+								  });
+				std::vector<size_t> face_order(nt);
+				tbb::parallel_for(size_t(0), nt, [&](size_t t)
+								  { face_order[t] = t; });
+				tbb::parallel_sort(face_order.begin(), face_order.end(), [&](size_t a, size_t b)
+								   { return std::lexicographical_compare(triangles.begin() + a * 3, triangles.begin() + a * 3 + 3,
+																		 triangles.begin() + b * 3, triangles.begin() + b * 3 + 3); });
+				std::vector<int> sorted(triangles.size());
+				tbb::parallel_for(size_t(0), nt, [&](size_t t)
+								  { std::copy_n(triangles.begin() + face_order[t] * 3, 3, sorted.begin() + t * 3); });
+				triangles.swap(sorted);
+			}
+		}
+	}
+}
@@ -0,0 +1,386 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MCMT_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
+namespace GEO
+{
+	enum MeshFormat
+	{
+		// ASCII Wavefront OBJ
+		MESH_OBJ,
+		// binary little endian PLY, float coordinates
+		MESH_PLY,
+		// binary STL, a triangle soup
+		MESH_STL
+	};
+
+	// format from the extension of filename, OBJ when it is not recognized
+	inline MeshFormat mesh_format(const std::string &filename)
+	{
+		size_t dot = filename.find_last_of('.');
+		std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c)
+					   { return char(std::tolower(c)); });
+		if (extension == "ply")
+			return MESH_PLY;
+		if (extension == "stl")
+			return MESH_STL;
+		return MESH_OBJ;
+	}
+
+	namespace MeshIO
+	{
+		// lines formatted per parallel chunk
+		const size_t chunk_lines = 1 << 16;
+
+		// shortest round trip text of x when to_chars is available, 17
+		// significant digits otherwise. buffer holds at least 32 chars
+		inline char *format_double(char *buffer, double x)
+		{
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+			return std::to_chars(buffer, buffer + 32, x).ptr;
+#else
+			return buffer + std::snprintf(buffer, 32, "%.17g", x);
+#endif
+		}
+
+		inline char *format_int(char *buffer, int64_t x)
+		{
+			char digits[24];
+			int n = 0;
+			bool negative = x < 0;
+			uint64_t u = negative ? uint64_t(0) - uint64_t(x) : uint64_t(x);
+			do
+			{
+				digits[n++] = char('0' + u % 10);
+				u /= 10;
+			} while (u);
+			if (negative)
+				*buffer++ = '-';
+			while (n)
+				*buffer++ = digits[--n];
+			return buffer;
+		}
+
+		// formats num_lines lines in parallel chunks, format_line(i, buffer)
+		// writes line i and returns its end. Chunks are written in order
+		template <class FormatLine>
+		bool write_lines(std::FILE *file, size_t num_lines, size_t max_line_size, const FormatLine &format_line)
+		{
+			size_t num_chunks = (num_lines + chunk_lines - 1) / chunk_lines;
+			std::vector<std::string> chunks(num_chunks);
+			tbb::parallel_for(size_t(0), num_chunks, [&](size_t c)
+							  {
+								  size_t begin = c * chunk_lines;
+								  size_t end = std::min(num_lines, begin + chunk_lines);
+								  std::string &chunk = chunks[c];
+								  chunk.resize((end - begin) * max_line_size);
+								  char *p = &chunk[0];
+								  for (size_t i = begin; i < end; i++)
+								  {
+									  p = format_line(i, p);
+								  }
+								  chunk.resize(p - chunk.data());
+							  });
+			for (size_t c = 0; c < num_chunks; c++)
+			{
+				if (std::fwrite(chunks[c].data(), 1, chunks[c].size(), file) != chunks[c].size())
+					return false;
+			}
+			return true;
+		}
+
+		inline bool write_obj(std::FILE *file, const std::vector<double> &vertices, const std::vector<int> &triangles)
+		{
+			bool ok = write_lines(file, vertices.size() / 3, 3 * 32 + 8, [&](size_t i, char *p)
+								  {
+									  *p++ = 'v';
+									  for (int c = 0; c < 3; c++)
+									  {
+										  *p++ = ' ';
+										  p = format_double(p, vertices[i * 3 + c]);
+									  }
+									  *p++ = '\n';
+									  return p;
+								  });
+			return ok && write_lines(file, triangles.size() / 3, 3 * 24 + 8, [&](size_t i, char *p)
+									 {
+										 *p++ = 'f';
+										 for (int k = 0; k < 3; k++)
+										 {
+											 *p++ = ' ';
+											 p = format_int(p, int64_t(triangles[i * 3 + k]) + 1);
+										 }
+										 *p++ = '\n';
+										 return p;
+									 });
+		}
+	}
+
+	// file of a known size mapped for writing, threads fill disjoint
+	// slices of data(). The blocks are reserved up front so that a full disk
+	// fails here rather than as a SIGBUS while writing. Falls back to a
+	// buffer written on close without mmap or when they cannot be reserved
+	class MappedFile
+	{
+	public:
+		MappedFile(const std::string &filename, size_t size) : size_(size), data_(nullptr), fd_(-1), buffered_(false), filename_(filename)
+		{
+#ifdef MCMT_HAS_MMAP
+			fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (fd_ < 0)
+				return;
+			if (size_ == 0)
+				return;
+			if (::ftruncate(fd_, off_t(size_)) != 0)
+			{
+				::close(fd_);
+				fd_ = -1;
+				return;
+			}
+			if (reserve())
+			{
+				void *data = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+				if (data != MAP_FAILED)
+				{
+					data_ = static_cast<char *>(data);
+					return;
+				}
+			}
+			::close(fd_);
+#endif
+			buffer_.resize(size_);
+			data_ = buffer_.data();
+			fd_ = 0;
+			buffered_ = true;
+		}
+
+		~MappedFile()
+		{
+			close();
+		}
+
+		MappedFile(const MappedFile &) = delete;
+		MappedFile &operator=(const MappedFile &) = delete;
+
+		bool is_open() const { return fd_ >= 0; }
+		char *data() { return data_; }
+		size_t size() const { return size_; }
+
+		// unmaps and closes the file, returns false on I/O errors
+		bool close()
+		{
+			if (fd_ < 0)
+				return false;
+			bool ok = true;
+			if (buffered_)
+			{
+				std::FILE *file = std::fopen(filename_.c_str(), "wb");
+				ok = file && std::fwrite(buffer_.data(), 1, size_, file) == size_;
+				ok = file && std::fclose(file) == 0 && ok;
+				std::vector<char>().swap(buffer_);
+			}
+#ifdef MCMT_HAS_MMAP
+			else
+			{
+				if (data_)
+					ok = ::munmap(data_, size_) == 0;
+				ok = ::close(fd_) == 0 && ok;
+			}
+#endif
+			data_ = nullptr;
+			fd_ = -1;
+			return ok;
+		}
+
+	private:
+#ifdef MCMT_HAS_MMAP
+		bool reserve()
+		{
+#ifdef __APPLE__
+			return false;
+#else
+			return ::posix_fallocate(fd_, 0, off_t(size_)) == 0;
+#endif
+		}
+#endif
+
+		size_t size_;
+		char *data_;
+		int fd_;
+		bool buffered_;
+		std::string filename_;
+		std::vector<char> buffer_;
+	};
+
+	// binary little endian PLY with float coordinates and triangle faces,
+	// sized up front. set_vertex and set_triangle are thread safe for
+	// distinct indices. Binary layouts are written in host byte order,
+	// little endian on every platform we build for
+	class MappedPly
+	{
+	public:
+		MappedPly(const std::string &filename, size_t num_vertices, size_t num_triangles)
+			: header_(header(num_vertices, num_triangles)), num_vertices_(num_vertices),
+			  file_(filename, header_.size() + num_vertices * vertex_size + num_triangles * face_size)
+		{
+			if (file_.is_open())
+				std::memcpy(file_.data(), header_.data(), header_.size());
+		}
+
+		bool is_open() const { return file_.is_open(); }
+
+		void set_vertex(size_t i, const double *p)
+		{
+			float xyz[3] = {float(p[0]), float(p[1]), float(p[2])};
+			std::memcpy(file_.data() + header_.size() + i * vertex_size, xyz, vertex_size);
+		}
+
+		void set_triangle(size_t i, int a, int b, int c)
+		{
+			char *face = file_.data() + header_.size() + num_vertices_ * vertex_size + i * face_size;
+			int32_t abc[3] = {a, b, c};
+			face[0] = 3;
+			std::memcpy(face + 1, abc, sizeof(abc));
+		}
+
+		bool close() { return file_.close(); }
+
+	private:
+		static const size_t vertex_size = 3 * sizeof(float);
+		static const size_t face_size = 1 + 3 * sizeof(int32_t);
+
+		static std::string header(size_t num_vertices, size_t num_triangles)
+		{
+			return "ply\nformat binary_little_endian 1.0\nelement vertex " + std::to_string(num_vertices) +
+				   "\nproperty float x\nproperty float y\nproperty float z\nelement face " + std::to_string(num_triangles) +
+				   "\nproperty list uchar int vertex_indices\nend_header\n";
+		}
+
+		std::string header_;
+		size_t num_vertices_;
+		MappedFile file_;
+	};
+
+	// binary STL triangle soup, sized up front, set_triangle is thread safe
+	// for distinct indices
+	class MappedStl
+	{
+	public:
+		MappedStl(const std::string &filename, size_t num_triangles) : file_(filename, 84 + num_triangles * triangle_size)
+		{
+			if (!file_.is_open())
+				return;
+			char header[80] = "binary STL";
+			uint32_t count = uint32_t(num_triangles);
+			std::memcpy(file_.data(), header, 80);
+			std::memcpy(file_.data() + 80, &count, sizeof(count));
+		}
+
+		bool is_open() const { return file_.is_open(); }
+
+		void set_triangle(size_t i, const double *a, const double *b, const double *c)
+		{
+			// normal, 3 corners, then a zero attribute count
+			float record[12];
+			double n[3] = {(b[1] - a[1]) * (c[2] - a[2]) - (b[2] - a[2]) * (c[1] - a[1]),
+						   (b[2] - a[2]) * (c[0] - a[0]) - (b[0] - a[0]) * (c[2] - a[2]),
+						   (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0])};
+			double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			for (int k = 0; k < 3; k++)
+			{
+				record[k] = length > 0 ? float(n[k] / length) : 0.0f;
+				record[3 + k] = float(a[k]);
+				record[6 + k] = float(b[k]);
+				record[9 + k] = float(c[k]);
+			}
+			char *p = file_.data() + 84 + i * triangle_size;
+			std::memcpy(p, record, sizeof(record));
+			p[48] = p[49] = 0;
+		}
+
+		bool close() { return file_.close(); }
+
+	private:
+		static const size_t triangle_size = 50;
+		MappedFile file_;
+	};
+
+	namespace MeshIO
+	{
+		inline bool write_ply(const std::string &filename, const std::vector<double> &vertices, const std::vector<int> &triangles)
+		{
+			MappedPly ply(filename, vertices.size() / 3, triangles.size() / 3);
+			if (!ply.is_open())
+				return false;
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices.size() / 3), [&](tbb::blocked_range<size_t> r)
+							  {
+								  for (size_t i = r.begin(); i < r.end(); i++)
+									  ply.set_vertex(i, vertices.data() + i * 3);
+							  });
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, triangles.size() / 3), [&](tbb::blocked_range<size_t> r)
+							  {
+								  for (size_t i = r.begin(); i < r.end(); i++)
+									  ply.set_triangle(i, triangles[i * 3], triangles[i * 3 + 1], triangles[i * 3 + 2]);
+							  });
+			return ply.close();
+		}
+
+		inline bool write_stl(const std::string &filename, const std::vector<double> &vertices, const std::vector<int> &triangles)
+		{
+			MappedStl stl(filename, triangles.size() / 3);
+			if (!stl.is_open())
+				return false;
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, triangles.size() / 3), [&](tbb::blocked_range<size_t> r)
+							  {
+								  for (size_t i = r.begin(); i < r.end(); i++)
+								  {
+									  stl.set_triangle(i, vertices.data() + triangles[i * 3] * 3, vertices.data() + triangles[i * 3 + 1] * 3,
+													   vertices.data() + triangles[i * 3 + 2] * 3);
+								  }
+							  });
+			return stl.close();
+		}
+	}
+
+	// writes vertices (xyz triplets) and triangles (index triplets) in the
+	// format given by the extension of filename, returns false on I/O errors
+	inline bool write_mesh(const std::string &filename, const std::vector<double> &vertices, const std::vector<int> &triangles)
+	{
+		switch (mesh_format(filename))
+		{
+		case MESH_PLY:
+			return MeshIO::write_ply(filename, vertices, triangles);
+		case MESH_STL:
+			return MeshIO::write_stl(filename, vertices, triangles);
+		default:
+			break;
+		}
+		std::FILE *file = std::fopen(filename.c_str(), "wb");
+		if (!file)
+			return false;
+		bool ok = MeshIO::write_obj(file, vertices, triangles);
+		return std::fclose(file) == 0 && ok;
+	}
+}
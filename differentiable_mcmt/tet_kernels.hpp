@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace GEO
+{
+	// Unsigned volumes of n tets stored as structure-of-arrays: coordinate c of
+	// corner k of tet i is coords[(k * 3 + c) * stride + i]. Works on stack
+	// arrays as well as on TetBatch storage.
+	inline void tet_volumes(size_t n, const double *coords, size_t stride, double *volumes)
+	{
+		const double *ax = coords, *ay = coords + stride, *az = coords + 2 * stride;
+		const double *bx = coords + 3 * stride, *by = coords + 4 * stride, *bz = coords + 5 * stride;
+		const double *cx = coords + 6 * stride, *cy = coords + 7 * stride, *cz = coords + 8 * stride;
+		const double *dx = coords + 9 * stride, *dy = coords + 10 * stride, *dz = coords + 11 * stride;
+		for (size_t i = 0; i < n; i++)
+		{
+			double ABx = bx[i] - ax[i], ABy = by[i] - ay[i], ABz = bz[i] - az[i];
+			double ACx = cx[i] - ax[i], ACy = cy[i] - ay[i], ACz = cz[i] - az[i];
+			double ADx = dx[i] - ax[i], ADy = dy[i] - ay[i], ADz = dz[i] - az[i];
+			double dot = ABx * (ACy * ADz - ACz * ADy) + ABy * (ACz * ADx - ACx * ADz) + ABz * (ACx * ADy - ACy * ADx);
+			volumes[i] = std::abs(dot) / 6.0;
+		}
+	}
+
+	// Structure-of-arrays batch of tetrahedra. Coordinate c of corner k of
+	// tet i is stored at coords_[(k * 3 + c) * capacity_ + i], so the kernels
+	// below run over contiguous arrays and vectorize.
+	class TetBatch
+	{
+	public:
+		explicit TetBatch(size_t capacity = 64) : size_(0), capacity_(0)
+		{
+			reserve(capacity);
+		}
+
+		size_t size() const { return size_; }
+		void clear() { size_ = 0; }
+
+		void reserve(size_t capacity)
+		{
+			if (capacity <= capacity_)
+				return;
+			std::vector<double> coords(12 * capacity);
+			for (size_t a = 0; a < 12; a++)
+			{
+				for (size_t i = 0; i < size_; i++)
+				{
+					coords[a * capacity + i] = coords_[a * capacity_ + i];
+				}
+			}
+			coords_.swap(coords);
+			capacity_ = capacity;
+		}
+
+		void push_back(const double *p0, const double *p1, const double *p2, const double *p3)
+		{
+			if (size_ == capacity_)
+				reserve(capacity_ == 0 ? 64 : 2 * capacity_);
+			const double *corners[4] = {p0, p1, p2, p3};
+			for (size_t k = 0; k < 4; k++)
+			{
+				for (size_t c = 0; c < 3; c++)
+				{
+					coords_[(k * 3 + c) * capacity_ + size_] = corners[k][c];
+				}
+			}
+			size_++;
+		}
+
+		const double *coord(size_t k, size_t c) const
+		{
+			return coords_.data() + (k * 3 + c) * capacity_;
+		}
+
+		// unsigned volume of every tet of the batch
+		void volumes(double *volumes) const
+		{
+			tet_volumes(size_, coords_.data(), capacity_, volumes);
+		}
+
+		// n uniform samples, sample j in tet tets[j]: stu holds 3 uniform
+		// numbers in [0, 1) per sample and points receives xyz triplets
+		void sample(size_t n, const size_t *tets, const double *stu, double *points) const
+		{
+			for (size_t j = 0; j < n; j++)
+			{
+				sample_one(tets[j], stu[j * 3], stu[j * 3 + 1], stu[j * 3 + 2], points + j * 3);
+			}
+		}
+
+		// uniform sample in tet i (Rocchini and Cignoni, folding of the unit cube)
+		void sample_one(size_t i, double s, double t, double u, double *point) const
+		{
+			bool fold_st = s + t > 1.0;
+			s = fold_st ? 1.0 - s : s;
+			t = fold_st ? 1.0 - t : t;
+			bool fold_tu = t + u > 1.0;
+			bool fold_stu = !fold_tu && s + t + u > 1.0;
+			double s2 = fold_stu ? 1.0 - t - u : s;
+			double t2 = fold_tu ? 1.0 - u : t;
+			double u2 = fold_tu ? 1.0 - s - t : (fold_stu ? s + t + u - 1.0 : u);
+			double a = 1.0 - s2 - t2 - u2;
+			for (size_t c = 0; c < 3; c++)
+			{
+				point[c] = a * coord(0, c)[i] + s2 * coord(1, c)[i] + t2 * coord(2, c)[i] + u2 * coord(3, c)[i];
+			}
+		}
+
+	private:
+		std::vector<double> coords_;
+		size_t size_;
+		size_t capacity_;
+	};
+}
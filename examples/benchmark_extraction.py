@@ -0,0 +1,153 @@
+import argparse
+import concurrent.futures
+import json
+import multiprocessing
+import os
+import resource
+import sys
+import time
+import numpy as np
+import mcubes
+from scipy.spatial import cKDTree
+sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+from mcgrids import McGrids
+
+# End-to-end McGrids benchmark on analytic shapes of the cube [-0.5, 0.5]^3.
+# For every shape it reports the wall time of each stage, the SDF query count,
+# the peak RSS and the Chamfer / Hausdorff distance to the analytic surface,
+# next to uniform marching cubes with the same number of SDF queries.
+
+CLIP_MIN = np.array([-0.5, -0.5, -0.5])
+CLIP_MAX = np.array([0.5, 0.5, 0.5])
+
+
+def sphere_sdf(points):
+    return np.linalg.norm(points, axis=1) - 0.3
+
+
+def box_sdf(points):
+    q = np.abs(points) - 0.25
+    outside = np.linalg.norm(np.maximum(q, 0.0), axis=1)
+    return outside + np.minimum(np.max(q, axis=1), 0.0)
+
+
+def torus_sdf(points):
+    q = np.stack((np.linalg.norm(points[:, [0, 2]], axis=1) - 0.25, points[:, 1]), axis=-1)
+    return np.linalg.norm(q, axis=1) - 0.1
+
+
+def csg_sdf(points):
+    # box with a spherical hole, a bound of the distance near the creases
+    hole = np.linalg.norm(points, axis=1) - 0.32
+    return np.maximum(box_sdf(points), -hole)
+
+
+SHAPES = {"sphere": sphere_sdf, "box": box_sdf, "torus": torus_sdf, "csg": csg_sdf}
+
+
+def sample_mesh(vertices, faces, num_samples, rng):
+    # area weighted uniform samples of a triangle mesh
+    triangles = vertices[faces]
+    areas = 0.5 * np.linalg.norm(np.cross(triangles[:, 1] - triangles[:, 0], triangles[:, 2] - triangles[:, 0]), axis=1)
+    face_ids = rng.choice(len(faces), size=num_samples, p=areas / areas.sum())
+    u = rng.random((num_samples, 1))
+    v = rng.random((num_samples, 1))
+    flip = (u + v) > 1
+    u = np.where(flip, 1 - u, u)
+    v = np.where(flip, 1 - v, v)
+    t = triangles[face_ids]
+    return t[:, 0] + u * (t[:, 1] - t[:, 0]) + v * (t[:, 2] - t[:, 0])
+
+
+def sample_surface(sdf_func, num_samples, rng, eps=1e-6):
+    # project random points of the domain onto the zero level set
+    points = rng.uniform(CLIP_MIN, CLIP_MAX, size=(4 * num_samples, 3))
+    for _ in range(16):
+        values = sdf_func(points)
+        gradient = np.stack([(sdf_func(points + eps * axis) - sdf_func(points - eps * axis)) / (2 * eps) for axis in np.eye(3)], axis=-1)
+        gradient /= np.maximum(np.linalg.norm(gradient, axis=1, keepdims=True), 1e-12)
+        points = points - values[:, None] * gradient
+    points = points[np.abs(sdf_func(points)) < 1e-6]
+    return points[:num_samples]
+
+
+def mesh_error(vertices, faces, sdf_func, surface_points, num_samples, rng):
+    if len(faces) == 0:
+        return {"chamfer": float("inf"), "hausdorff": float("inf")}
+    mesh_points = sample_mesh(vertices, faces, num_samples, rng)
+    mesh_to_surface = np.abs(sdf_func(mesh_points))
+    surface_to_mesh, _ = cKDTree(mesh_points).query(surface_points)
+    return {"chamfer": float(0.5 * (mesh_to_surface.mean() + surface_to_mesh.mean())),
+            "hausdorff": float(max(mesh_to_surface.max(), surface_to_mesh.max()))}
+
+
+def peak_rss_mb():
+    # ru_maxrss is in kilobytes on Linux
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024.0
+
+
+def run_mcgrids(shape, args):
+    sdf_func = SHAPES[shape]
+    grids = McGrids(sdf_func, clip_min=CLIP_MIN, clip_max=CLIP_MAX, initial_resolution=args.resolution, num_sample_iters=args.num_sample_iters,
+                    num_sample_points=args.num_sample_points, num_mid_iters=args.num_mid_iters, threshold=args.threshold,
+                    refine_steps=args.refine_steps, extraction_mode=args.extraction_mode)
+    start_time = time.time()
+    vertices, faces = grids.extract_mesh()
+    return {"wall_time": time.time() - start_time, "stage_times": grids.stage_times, "sdf_queries": grids.query_count,
+            "peak_rss_mb": peak_rss_mb(), "vertices": vertices, "faces": faces}
+
+
+def run_marching_cubes(shape, num_queries):
+    sdf_func = SHAPES[shape]
+    resolution = int(np.ceil(np.cbrt(num_queries)))
+    start_time = time.time()
+    axes = [np.linspace(CLIP_MIN[c], CLIP_MAX[c], resolution) for c in range(3)]
+    X, Y, Z = np.meshgrid(*axes, indexing="ij")
+    values = sdf_func(np.stack((X.flatten(), Y.flatten(), Z.flatten()), axis=-1)).reshape(X.shape)
+    sdf_time = time.time() - start_time
+    vertices, faces = mcubes.marching_cubes(values, 0)
+    vertices = CLIP_MIN + vertices * (CLIP_MAX - CLIP_MIN) / (resolution - 1)
+    return {"wall_time": time.time() - start_time, "stage_times": {"sdf": sdf_time, "extraction": time.time() - start_time - sdf_time},
+            "sdf_queries": resolution ** 3, "resolution": resolution, "peak_rss_mb": peak_rss_mb(), "vertices": vertices, "faces": faces}
+
+
+def run_in_subprocess(function, *args):
+    # fresh process per run, so that the mcmt state and the peak RSS are per run
+    with concurrent.futures.ProcessPoolExecutor(max_workers=1, mp_context=multiprocessing.get_context("spawn")) as executor:
+        return executor.submit(function, *args).result()
+
+
+if __name__ == "__main__":
+
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--shapes', type=str, nargs='+', default=list(SHAPES.keys()), choices=list(SHAPES.keys()), help='Shapes to extract')
+    parser.add_argument('--threshold', type=float, default=1e-4, help='Terminating threshold')
+    parser.add_argument('--resolution', type=int, default=4, help='Initial resolution')
+    parser.add_argument('--num_sample_iters', type=int, default=20, help='Number of sample iterations')
+    parser.add_argument('--num_sample_points', type=int, default=128, help='Number of sample points')
+    parser.add_argument('--num_mid_iters', type=int, default=300, help='Number of mid iterations')
+    parser.add_argument('--refine_steps', type=int, default=0, help='Number of batched secant steps on the extracted vertices')
+    parser.add_argument('--extraction_mode', type=str, default='marching_tets', choices=['marching_tets', 'dual'], help='Mesh extraction mode')
+    parser.add_argument('--num_error_samples', type=int, default=200000, help='Number of samples of the error metrics')
+    parser.add_argument('--output_path', type=str, default='benchmark_extraction.json', help='Path to the JSON report')
+    args = parser.parse_args()
+
+    rng = np.random.default_rng(0)
+    report = {"parameters": vars(args), "shapes": {}}
+    for shape in args.shapes:
+        surface_points = sample_surface(SHAPES[shape], args.num_error_samples, rng)
+        results = {}
+        results["mcgrids"] = run_in_subprocess(run_mcgrids, shape, args)
+        results["marching_cubes"] = run_in_subprocess(run_marching_cubes, shape, results["mcgrids"]["sdf_queries"])
+        for method, result in results.items():
+            vertices = result.pop("vertices")
+            faces = result.pop("faces")
+            result["num_vertices"] = len(vertices)
+            result["num_faces"] = len(faces)
+            result.update(mesh_error(vertices, faces, SHAPES[shape], surface_points, args.num_error_samples, rng))
+            print(f"{shape:8s} {method:15s} time {result['wall_time']:8.3f}s  queries {result['sdf_queries']:9d}  "
+                  f"rss {result['peak_rss_mb']:8.1f}MB  chamfer {result['chamfer']:.3e}  hausdorff {result['hausdorff']:.3e}")
+        report["shapes"][shape] = results
+
+    with open(args.output_path, "w") as f:
+        json.dump(report, f, indent=2)
@@ -1,17 +1,14 @@
 import mcmt
-import open3d as o3d
 import numpy as np
 import time
 import tqdm
 import torch
 import mcubes
-import os
-import tempfile
 
 
 class McGrids:
 
-    def __init__(self, sdf_func, clip_min, clip_max, initial_resolution, num_sample_iters, num_sample_points, num_mid_iters, threshold, verbose=False, disable_cvt=False):
+    def __init__(self, sdf_func, clip_min, clip_max, initial_resolution, num_sample_iters, num_sample_points, num_mid_iters, threshold, verbose=False, disable_cvt=False, refine_steps=0, extraction_mode="marching_tets"):
         self.sdf_func = sdf_func
         self.clip_min = clip_min
         self.clip_max = clip_max
@@ -21,10 +18,16 @@ class McGrids:
         self.num_sample_points = num_sample_points
         self.num_mid_iters = num_mid_iters
         self.threshold = threshold
+        # batched secant steps moving the extracted vertices onto the surface
+        self.refine_steps = refine_steps
+        # "marching_tets" or "dual", which keeps sharp features
+        self.extraction_mode = extraction_mode
         self.verbose = verbose
         self.query_count = 0
         self.sdf_query_time = 0
         self.compute_time = 0
+        # wall time of the initial grid, sampling, mid point and extraction stages
+        self.stage_times = {}
         self.completed = False
         mcmt.clear_mcmt()
 
@@ -49,16 +52,21 @@ class McGrids:
         X, Y, Z = np.meshgrid(XX, YY, ZZ)
         points = np.stack((X.flatten(), Y.flatten(), Z.flatten()), axis=-1)
         point_values = self.__sdf__(points)
+        mcmt.set_domain(list(self.clip_min), list(self.clip_max))
         mcmt.add_points(points, point_values)
+        self.stage_times["initial_grid"] = time.time() - start_time
+        stage_start = time.time()
 
         # sample from distribution and refine approximation
         for i in tqdm.tqdm(range(self.num_sample_iters), disable=not self.verbose):
             sample_points = mcmt.sample_points_voronoi(
                 self.num_sample_points).reshape(-1, 3)
             if not self.disbale_cvt:
-                sample_points = mcmt.lloyd_relaxation(sample_points, 1, -0.5, 0.5).reshape(-1, 3)
-            sample_values = self.sdf_func(sample_points)
+                sample_points = mcmt.lloyd_relaxation(sample_points, 1, -0.5, 0.5, local=True).reshape(-1, 3)
+            sample_values = self.__sdf__(sample_points)
             mcmt.add_points(sample_points, sample_values)
+        self.stage_times["sampling"] = time.time() - stage_start
+        stage_start = time.time()
 
         # mid point refinement
         pbar = tqdm.tqdm(range(self.num_mid_iters), disable=not self.verbose)
@@ -73,9 +81,10 @@ class McGrids:
             if len(next_points) == 0:
                 break
             if not self.disbale_cvt:
-                next_points = mcmt.lloyd_relaxation(next_points, 1, -0.5, 0.5).reshape(-1, 3)
+                next_points = mcmt.lloyd_relaxation(next_points, 1, -0.5, 0.5, local=True).reshape(-1, 3)
                 next_values = self.__sdf__(next_points)
             mcmt.add_mid_points(next_points, next_values)
+        self.stage_times["mid_points"] = time.time() - stage_start
         self.completed = True
         self.compute_time = time.time() - start_time
 
@@ -87,12 +96,15 @@ class McGrids:
                 print(f"SDF Query Count: {self.query_count}")
                 print(f"Equalent to MarchingCube of resolution: {np.ceil(np.cbrt(self.query_count))} ")
                 print(f"SDF Query Time: {self.sdf_query_time}")
-        with tempfile.TemporaryDirectory() as tmpdirname:
-            mcmt.output_triangle_mesh(os.path.join(tmpdirname, "mesh.obj"))
-            mesh = o3d.io.read_triangle_mesh(
-                os.path.join(tmpdirname, "mesh.obj"))
-        vertices = np.asarray(mesh.vertices)
-        faces = np.asarray(mesh.triangles)
+        start_time = time.time()
+        mcmt.set_extraction_mode(self.extraction_mode)
+        if self.refine_steps > 0:
+            vertices, faces = mcmt.get_triangle_mesh_refined(lambda points: torch.as_tensor(self.__sdf__(points.numpy())), self.refine_steps)
+        else:
+            vertices, faces = mcmt.get_triangle_mesh()
+        vertices = vertices.numpy().astype(np.float64)
+        faces = faces.numpy()
+        self.stage_times["extraction"] = time.time() - start_time
         return vertices, faces
 
     def extract_grid(self):
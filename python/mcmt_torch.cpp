@@ -1,11 +1,58 @@
 #include <torch/extension.h>
+#include <pybind11/functional.h>
 
 #include "fast_mcmt.hpp"
 
 
 namespace mcmt
 {
-  GEO::MCMT mcmt = GEO::MCMT();
+  GEO::MCMT mcmt;
+
+    void set_domain(const std::vector<double>& min_corner, const std::vector<double>& max_corner)
+    {
+        if (min_corner.size() != 3 || max_corner.size() != 3)
+        {
+            throw std::runtime_error("Domain corners must have 3 coordinates");
+        }
+        mcmt.set_domain(min_corner.data(), max_corner.data());
+    }
+
+    void set_periodic(bool periodic)
+    {
+        mcmt.set_periodic(periodic);
+    }
+
+    void set_extraction_mode(const std::string& mode)
+    {
+        if (mode == "marching_tets")
+        {
+            mcmt.set_extraction_mode(GEO::EXTRACTION_MARCHING_TETS);
+        }
+        else if (mode == "dual")
+        {
+            mcmt.set_extraction_mode(GEO::EXTRACTION_DUAL);
+        }
+        else
+        {
+            throw std::runtime_error("Extraction mode must be 'marching_tets' or 'dual'");
+        }
+    }
+
+    void set_boundary_mode(const std::string& mode)
+    {
+        if (mode == "clamp")
+        {
+            mcmt.set_boundary_mode(GEO::BOUNDARY_CLAMP);
+        }
+        else if (mode == "reflect")
+        {
+            mcmt.set_boundary_mode(GEO::BOUNDARY_REFLECT);
+        }
+        else
+        {
+            throw std::runtime_error("Boundary mode must be 'clamp' or 'reflect'");
+        }
+    }
 
     void add_points(torch::Tensor point_positions, torch::Tensor point_values)
     {
@@ -73,6 +120,90 @@ namespace mcmt
         return result.clone();
     }
 
+    pybind11::dict get_sampling_stats()
+    {
+        const GEO::SamplingStats& stats = mcmt.get_sampling_stats();
+        pybind11::dict result;
+        result["num_proposed"] = stats.num_proposed;
+        result["num_accepted"] = stats.num_accepted;
+        result["num_envelope_blocks"] = stats.num_envelope_blocks;
+        result["acceptance_rate"] = stats.acceptance_rate;
+        return result;
+    }
+
+    void enable_stats(bool enable)
+    {
+        mcmt.enable_stats(enable);
+    }
+
+    void reset_stats()
+    {
+        mcmt.reset_stats();
+    }
+
+    void enable_trace(bool enable)
+    {
+        mcmt.enable_trace(enable);
+    }
+
+    void save_trace(const std::string& filename)
+    {
+        if (!mcmt.save_trace(filename))
+        {
+            throw std::runtime_error("Tracing is disabled or the trace file could not be written");
+        }
+    }
+
+    pybind11::dict get_stats()
+    {
+        const GEO::MCMTStats& stats = mcmt.get_stats();
+        pybind11::dict stage_seconds, stage_calls, counters;
+        for (int s = 0; s < GEO::NUM_STAGES; s++)
+        {
+            stage_seconds[GEO::MCMTStats::stage_name(s)] = stats.stage_seconds[s];
+            stage_calls[GEO::MCMTStats::stage_name(s)] = stats.stage_calls[s];
+        }
+        for (int c = 0; c < GEO::NUM_COUNTERS; c++)
+        {
+            counters[GEO::MCMTStats::counter_name(c)] = stats.counters[c];
+        }
+        GEO::MemoryUsage memory = mcmt.get_memory_usage();
+        pybind11::dict memory_bytes;
+        memory_bytes["point_store"] = memory.point_store;
+        memory_bytes["triangulation"] = memory.triangulation;
+        memory_bytes["scratch_triangulation"] = memory.scratch_triangulation;
+        memory_bytes["kdtree"] = memory.kdtree;
+        memory_bytes["point_index"] = memory.point_index;
+        memory_bytes["output_meshes"] = memory.output_meshes;
+        memory_bytes["total"] = memory.total();
+        memory_bytes["peak"] = memory.peak;
+        pybind11::dict result;
+        result["stage_seconds"] = stage_seconds;
+        result["stage_calls"] = stage_calls;
+        result["counters"] = counters;
+        result["memory_bytes"] = memory_bytes;
+        return result;
+    }
+
+    void set_memory_budget(size_t budget_bytes)
+    {
+        mcmt.set_memory_budget(budget_bytes);
+    }
+
+    void set_mesh_cleanup(bool enable, double weld_tolerance, double min_area, bool reorder)
+    {
+        GEO::MeshCleanupOptions options;
+        options.weld_tolerance = weld_tolerance;
+        options.min_area = min_area;
+        options.reorder = reorder;
+        mcmt.set_mesh_cleanup(enable, options);
+    }
+
+    void compact()
+    {
+        mcmt.compact();
+    }
+
       torch::Tensor sample_points_voronoi(int num_points)
     {
         std::vector<double> new_samples = mcmt.sample_points_voronoi(num_points);
@@ -87,7 +218,8 @@ namespace mcmt
         return result.clone();
     }
 
-    torch::Tensor lloyd_relaxation(torch::Tensor point_positions, int num_iter, double min_value, double max_value)
+    torch::Tensor lloyd_relaxation(torch::Tensor point_positions, int num_iter, double min_value, double max_value, bool local,
+                                   bool density_weighted, double tolerance)
     {
         if (!point_positions.device().is_cpu())
         {
@@ -102,7 +234,30 @@ namespace mcmt
 
         double* point_positions_ptr = point_positions.data_ptr<double>();
 
-        std::vector<double> new_samples = mcmt.lloyd_relaxation(point_positions_ptr, num_points, num_iter);
+        std::vector<double> new_samples = mcmt.lloyd_relaxation(point_positions_ptr, num_points, num_iter, local ? GEO::LLOYD_LOCAL : GEO::LLOYD_GLOBAL,
+                                                                density_weighted, tolerance);
+
+        torch::Tensor result = torch::from_blob(new_samples.data(), {(int64_t)new_samples.size()}, torch::kDouble);
+        return result.clone();
+    }
+
+    torch::Tensor lbfgs_relaxation(torch::Tensor point_positions, int max_iter, bool local, bool density_weighted, double tolerance)
+    {
+        if (!point_positions.device().is_cpu())
+        {
+            throw std::runtime_error("Input tensor must be on CPU");
+        }
+        if (point_positions.scalar_type() != torch::kDouble)
+        {
+            throw std::runtime_error("Input tensor must be of type torch.double (double)");
+        }
+
+        int64_t num_points = point_positions.size(0);
+
+        double* point_positions_ptr = point_positions.data_ptr<double>();
+
+        std::vector<double> new_samples = mcmt.lbfgs_relaxation(point_positions_ptr, num_points, max_iter, local ? GEO::LLOYD_LOCAL : GEO::LLOYD_GLOBAL,
+                                                                density_weighted, tolerance);
 
         torch::Tensor result = torch::from_blob(new_samples.data(), {(int64_t)new_samples.size()}, torch::kDouble);
         return result.clone();
@@ -115,11 +270,113 @@ namespace mcmt
         return result.clone();
     }
 
-    torch::Tensor get_grids()
+    // clip is a dict with the optional keys "planes" ([nx, ny, nz, d] lists),
+    // "boxes" ([min x, y, z, max x, y, z]), "spheres" ([x, y, z, r]),
+    // "whole_tets", "iso_crossing" and "iso_value", on top of the x clip plane
+    GEO::GridClip make_clip(float x_clip_plane, const pybind11::dict& clip)
     {
-        std::vector<int> grid = mcmt.get_grids();
-        torch::Tensor result = torch::from_blob(grid.data(), {(int64_t)grid.size()}, torch::kInt);
-        return result.clone();
+        GEO::GridClip result = std::isinf(x_clip_plane) && x_clip_plane < 0 ? GEO::GridClip() : GEO::GridClip::x_plane(x_clip_plane);
+        for (auto item : clip)
+        {
+            std::string key = item.first.cast<std::string>();
+            if (key == "planes")
+            {
+                for (const auto& plane : item.second.cast<std::vector<std::array<double, 4>>>())
+                    result.planes.push_back(plane);
+            }
+            else if (key == "boxes")
+                result.boxes = item.second.cast<std::vector<std::array<double, 6>>>();
+            else if (key == "spheres")
+                result.spheres = item.second.cast<std::vector<std::array<double, 4>>>();
+            else if (key == "whole_tets")
+                result.whole_tets = item.second.cast<bool>();
+            else if (key == "iso_crossing")
+                result.iso_crossing = item.second.cast<bool>();
+            else if (key == "iso_value")
+                result.iso_value = item.second.cast<double>();
+            else
+                throw std::runtime_error("Unknown clip key '" + key + "'");
+        }
+        return result;
+    }
+
+    // tets are written straight into the returned tensor
+    torch::Tensor grids_tensor(const GEO::GridClip& clip)
+    {
+        torch::Tensor result = torch::empty({(int64_t)mcmt.count_grids(clip), 4}, torch::kInt);
+        mcmt.copy_grids(result.data_ptr<int>(), result.size(0), clip);
+        return result;
+    }
+
+    torch::Tensor get_grids(float x_clip_plane, const pybind11::dict& clip)
+    {
+        return grids_tensor(make_clip(x_clip_plane, clip)).view({-1});
+    }
+
+    // callback receives (num_tets, 4) int32 blocks that are only valid during the call
+    void stream_grids(const std::function<void(torch::Tensor)>& callback, float x_clip_plane, const pybind11::dict& clip, size_t block_cells)
+    {
+        mcmt.stream_grids([&](const int* tets, size_t num_tets) {
+            callback(torch::from_blob(const_cast<int*>(tets), {(int64_t)num_tets, 4}, torch::kInt));
+        }, make_clip(x_clip_plane, clip), block_cells);
+    }
+
+    void save_grids(const std::string& filename, float x_clip_plane, const pybind11::dict& clip)
+    {
+        mcmt.save_grids(filename, make_clip(x_clip_plane, clip));
+    }
+
+    // gradient, when given, maps a (n, 3) tensor of points to their (n, 3) SDF gradients
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> get_triangle_mesh_normals(const pybind11::object& gradient)
+    {
+        GEO::MCMT::GradientFunction gradient_function;
+        if (!gradient.is_none())
+        {
+            gradient_function = [&](size_t n, const double* points, double* gradients) {
+                torch::Tensor input = torch::from_blob(const_cast<double*>(points), {(int64_t)n, 3}, torch::kDouble).clone();
+                torch::Tensor result = gradient(input).cast<torch::Tensor>().to(torch::kCPU, torch::kDouble).contiguous();
+                if (result.numel() != (int64_t)n * 3)
+                {
+                    throw std::runtime_error("The gradient callback must return a (n, 3) tensor");
+                }
+                std::memcpy(gradients, result.data_ptr<double>(), n * 3 * sizeof(double));
+            };
+        }
+        std::vector<double> vertices, normals;
+        std::vector<int> faces;
+        mcmt.get_triangle_mesh(vertices, faces, normals, gradient_function);
+
+        int64_t nv = vertices.size() / 3, nf = faces.size() / 3;
+        torch::Tensor vertices_tensor = torch::from_blob(vertices.data(), {nv, 3}, torch::kDouble).to(torch::kFloat);
+        torch::Tensor faces_tensor = torch::from_blob(faces.data(), {nf, 3}, torch::kInt).to(torch::kLong);
+        torch::Tensor normals_tensor = torch::from_blob(normals.data(), {nv, 3}, torch::kDouble).to(torch::kFloat);
+        return std::make_tuple(vertices_tensor, faces_tensor, normals_tensor);
+    }
+
+    // sdf maps a (n, 3) tensor of points to their n SDF values, it is only held during the call
+    std::tuple<torch::Tensor, torch::Tensor> get_triangle_mesh_refined(const pybind11::object& sdf, int num_steps, double tolerance)
+    {
+        struct RefinementGuard
+        {
+            ~RefinementGuard() { mcmt.set_surface_refinement(GEO::MCMT::SDFFunction(), 0); }
+        } guard;
+        mcmt.set_surface_refinement([&](size_t n, const double* points, double* values) {
+            torch::Tensor input = torch::from_blob(const_cast<double*>(points), {(int64_t)n, 3}, torch::kDouble).clone();
+            torch::Tensor result = sdf(input).cast<torch::Tensor>().to(torch::kCPU, torch::kDouble).contiguous();
+            if (result.numel() != (int64_t)n)
+            {
+                throw std::runtime_error("The sdf callback must return n values");
+            }
+            std::memcpy(values, result.data_ptr<double>(), n * sizeof(double));
+        }, num_steps, tolerance);
+
+        std::vector<double> vertices;
+        std::vector<int> faces;
+        mcmt.get_triangle_mesh(vertices, faces);
+        int64_t nv = vertices.size() / 3, nf = faces.size() / 3;
+        torch::Tensor vertices_tensor = torch::from_blob(vertices.data(), {nv, 3}, torch::kDouble).to(torch::kFloat);
+        torch::Tensor faces_tensor = torch::from_blob(faces.data(), {nf, 3}, torch::kInt).to(torch::kLong);
+        return std::make_tuple(vertices_tensor, faces_tensor);
     }
 
     void output_triangle_mesh(const std::string& filename)
@@ -127,9 +384,9 @@ namespace mcmt
         mcmt.save_triangle_mesh(filename);
     }
 
-    void output_grid_mesh(const std::string& filename, float x_clip_plane)
+    void output_grid_mesh(const std::string& filename, float x_clip_plane, const pybind11::dict& clip)
     {
-        mcmt.save_grid_mesh(filename, x_clip_plane);
+        mcmt.save_grid_mesh(filename, make_clip(x_clip_plane, clip));
     }
 
 
@@ -138,19 +395,62 @@ namespace mcmt
         mcmt.clear();
     }
 
+    void save_state(const std::string& filename)
+    {
+        mcmt.save_state(filename);
+    }
+
+    void load_state(const std::string& filename)
+    {
+        mcmt.load_state(filename);
+    }
+
     PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
     {
+        m.def("set_domain", &set_domain, "Set the axis aligned domain box of MCMT");
+        m.def("set_periodic", &set_periodic, "Mesh the domain [0, L]^3 periodically, call before adding points");
+        m.def("set_boundary_mode", &set_boundary_mode, "Keep relaxed points in a non-periodic domain by 'clamp' or 'reflect'");
+        m.def("set_extraction_mode", &set_extraction_mode, "Extract triangle meshes by 'marching_tets' or by 'dual' contouring, which keeps sharp features");
         m.def("add_points", &add_points, "Add points to MCMT");
         m.def("add_mid_points", &add_mid_points, "Add mid-points to MCMT");
         m.def("sample_points_rejection", &sample_points_rejection, "Sample points using rejection method");
+        m.def("get_sampling_stats", &get_sampling_stats, "Get statistics of the last rejection sampling call");
+        m.def("enable_stats", &enable_stats, "Turn the stage timers and counters of MCMT on or off");
+        m.def("reset_stats", &reset_stats, "Reset the stage timers and counters");
+        m.def("get_stats", &get_stats, "Get the stage timers and counters accumulated since the last reset");
+        m.def("set_mesh_cleanup", &set_mesh_cleanup, "Weld, drop degenerate faces and reorder the extracted triangle meshes",
+              pybind11::arg("enable"), pybind11::arg("weld_tolerance") = 0.0, pybind11::arg("min_area") = 0.0, pybind11::arg("reorder") = true);
+        m.def("set_memory_budget", &set_memory_budget, "Limit the bytes held by MCMT, 0 disables the limit");
+        m.def("compact", &compact, "Drop the caches of MCMT and shrink its point store");
+        m.def("enable_trace", &enable_trace, "Record a timeline of the MCMT stages and TBB tasks");
+        m.def("save_trace", &save_trace, "Write the recorded timeline as Chrome trace JSON");
         m.def("sample_points_voronoi", &sample_points_voronoi, "Sample points using Voronoi method");
-        m.def("lloyd_relaxation", &lloyd_relaxation, "Perform Lloyd relaxation");
+        m.def("lloyd_relaxation", &lloyd_relaxation, "Perform Lloyd relaxation",
+              pybind11::arg("point_positions"), pybind11::arg("num_iter"), pybind11::arg("min_value"), pybind11::arg("max_value"),
+              pybind11::arg("local") = false, pybind11::arg("density_weighted") = false, pybind11::arg("tolerance") = 0.0);
+        m.def("lbfgs_relaxation", &lbfgs_relaxation, "Minimize the CVT energy with L-BFGS",
+              pybind11::arg("point_positions"), pybind11::arg("max_iter"), pybind11::arg("local") = false,
+              pybind11::arg("density_weighted") = false, pybind11::arg("tolerance") = 0.0);
         m.def("get_grid_points", &get_grid_points, "Get grid points");
         m.def("get_mid_points", &get_mid_points, "Get mid-points");
-        m.def("get_grids", &get_grids, "Get grids");
+        m.def("get_grids", &get_grids, "Get the tets as a flat int32 tensor of 4 vertex indices each",
+              pybind11::arg("x_clip_plane") = -std::numeric_limits<float>::infinity(), pybind11::arg("clip") = pybind11::dict());
+        m.def("stream_grids", &stream_grids, "Hand the tets to a callback in (num_tets, 4) int32 blocks",
+              pybind11::arg("callback"), pybind11::arg("x_clip_plane") = -std::numeric_limits<float>::infinity(),
+              pybind11::arg("clip") = pybind11::dict(), pybind11::arg("block_cells") = 1 << 20);
+        m.def("save_grids", &save_grids, "Write the tets as a raw int32 file of 4 vertex indices each",
+              pybind11::arg("filename"), pybind11::arg("x_clip_plane") = -std::numeric_limits<float>::infinity(),
+              pybind11::arg("clip") = pybind11::dict());
+        m.def("get_triangle_mesh_normals", &get_triangle_mesh_normals, "Get triangle mesh vertices, faces and unit SDF gradient normals",
+              pybind11::arg("gradient") = pybind11::none());
+        m.def("get_triangle_mesh_refined", &get_triangle_mesh_refined, "Get triangle mesh with the vertices refined along their edges by batched SDF queries",
+              pybind11::arg("sdf"), pybind11::arg("num_steps") = 4, pybind11::arg("tolerance") = 0.0);
         m.def("output_triangle_mesh", &output_triangle_mesh, "Output triangle mesh");
-        m.def("output_grid_mesh", &output_grid_mesh, "Output grid mesh");
+        m.def("output_grid_mesh", &output_grid_mesh, "Output grid mesh",
+              pybind11::arg("filename"), pybind11::arg("x_clip_plane"), pybind11::arg("clip") = pybind11::dict());
         m.def("clear_mcmt", &clear_mcmt, "Clear MCMT");
+        m.def("save_state", &save_state, "Checkpoint the MCMT state to a binary file");
+        m.def("load_state", &load_state, "Resume from a checkpoint written by save_state");
         m.def("get_triangle_mesh", []() {
             auto [vertices, faces] = mcmt.get_triangle_mesh();
             
@@ -182,36 +482,9 @@ namespace mcmt
             
             return std::make_tuple(vertices_tensor, faces_tensor);
         }, "Get triangle mesh as vertices and faces tensors");
-        m.def("get_grid_mesh", [](float x_clip_plane) {
-        auto [vertices, faces] = mcmt.get_grid_mesh(x_clip_plane);
-        
-        // Convert vertices to torch tensor
-        std::vector<float> vertices_flat;
-        vertices_flat.reserve(vertices.size() * 3);
-        for (const auto& v : vertices) {
-            vertices_flat.push_back(v[0]);
-            vertices_flat.push_back(v[1]);
-            vertices_flat.push_back(v[2]);
-        }
-        
-        // Convert faces to torch tensor
-        std::vector<int64_t> faces_flat;
-        faces_flat.reserve(faces.size() * 3);
-        for (const auto& f : faces) {
-            faces_flat.push_back(f[0]);
-            faces_flat.push_back(f[1]);
-            faces_flat.push_back(f[2]);
-        }
-        
-        auto vertices_tensor = torch::from_blob(vertices_flat.data(), 
-                                            {(int64_t)vertices.size(), 3}, 
-                                            torch::kFloat).clone();
-        
-        auto faces_tensor = torch::from_blob(faces_flat.data(), 
-                                        {(int64_t)faces.size(), 3}, 
-                                        torch::kLong).clone();
-        
-        return std::make_tuple(vertices_tensor, faces_tensor);
-    }, "Get grid mesh as vertices and faces tensors");
+        m.def("get_grid_mesh", [](float x_clip_plane, const pybind11::dict& clip) {
+            return std::make_tuple(get_grid_points().view({-1, 3}).to(torch::kFloat), grids_tensor(make_clip(x_clip_plane, clip)));
+        }, "Get grid mesh as vertices and (num_tets, 4) int32 tets tensors",
+        pybind11::arg("x_clip_plane"), pybind11::arg("clip") = pybind11::dict());
         }
 }